@@ -1,7 +1,13 @@
 #include "test_runner.h"
+#include "profile.h"
 
+#include <array>
+#include <charconv>
+#include <cstdlib>
+#include <new>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
 #include <utility>
@@ -27,17 +33,172 @@ pair<string, string> SplitBy(const string& what, const string& by) {
     }
 }
 
-template<typename T>
-T FromString(const string& s) {
-    T x;
-    istringstream is(s);
-    is >> x;
-    return x;
+// All of s as a decimal number; nullopt for anything else, including
+// trailing garbage ("12abc") and numbers that don't fit
+optional<size_t> ParseUnsigned(string_view s) {
+    size_t value;
+    auto [end, error] = from_chars(s.data(), s.data() + s.size(), value);
+    if (error != errc() || end == s.data() || end != s.data() + s.size()) {
+        return nullopt;
+    }
+    return value;
+}
+
+optional<size_t> ParseId(string_view s) {
+    return ParseUnsigned(s);
+}
+
+// "<id> <content>"; the content points into body
+pair<optional<size_t>, string_view> ParseIdAndContent(string_view body) {
+    size_t pos = body.find(' ');
+    if (pos == string_view::npos) {
+        return {ParseId(body), {}};
+    }
+    return {ParseId(body.substr(0, pos)), body.substr(pos + 1)};
+}
+
+// Header names are ASCII; unlike tolower this doesn't consult the locale
+char AsciiLower(char c) {
+    return 'A' <= c && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+struct HttpHeaderView {
+    string_view name, value;
+};
+
+// A request parsed in place: every field points into the raw buffer,
+// which has to outlive the view. Headers go into a fixed array, so
+// parsing never allocates.
+struct HttpRequestView {
+    static constexpr size_t MAX_HEADERS = 32;
+
+    string_view method, path, query, body;
+    array<HttpHeaderView, MAX_HEADERS> headers;
+    size_t header_count = 0;
+
+    // Header names compare case-insensitively
+    optional<string_view> GetHeader(string_view name) const {
+        for (size_t i = 0; i < header_count; ++i) {
+            const string_view header = headers[i].name;
+            if (header.size() == name.size()
+                && equal(header.begin(), header.end(), name.begin(), [](char lhs, char rhs) {
+                       return AsciiLower(lhs) == AsciiLower(rhs);
+                   })) {
+                return headers[i].value;
+            }
+        }
+        return nullopt;
+    }
+
+    // Value of name in "a=1&b=2", not percent-decoded
+    optional<string_view> GetParam(string_view name) const {
+        string_view rest = query;
+        while (!rest.empty()) {
+            size_t end = rest.find('&');
+            string_view param = rest.substr(0, end);
+            rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+            size_t eq = param.find('=');
+            if (param.substr(0, eq) == name) {
+                return eq == string_view::npos ? string_view() : param.substr(eq + 1);
+            }
+        }
+        return nullopt;
+    }
+};
+
+namespace http_parse_detail {
+
+// Cuts the next line off text; lines end in "\n" or "\r\n"
+optional<string_view> NextLine(string_view& text) {
+    size_t end = text.find('\n');
+    if (end == string_view::npos) {
+        return nullopt;
+    }
+    string_view line = text.substr(0, end);
+    text.remove_prefix(end + 1);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    return line;
 }
 
-pair<size_t, string> ParseIdAndContent(const string& body) {
-    auto [id_string, content] = SplitBy(body, " ");
-    return {FromString<size_t>(id_string), content};
+string_view Trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+optional<size_t> ParseContentLength(string_view value) {
+    return ParseUnsigned(value);
+}
+
+}  // namespace http_parse_detail
+
+// Parses "METHOD target HTTP/x.y", the headers and the body. The body is
+// Content-Length bytes if the header is there, the rest of raw otherwise.
+// Returns nullopt for malformed or incomplete requests.
+optional<HttpRequestView> ParseHttpRequest(string_view raw) {
+    using namespace http_parse_detail;
+    HttpRequestView req;
+
+    auto request_line = NextLine(raw);
+    if (!request_line) {
+        return nullopt;
+    }
+    size_t method_end = request_line->find(' ');
+    size_t target_end = request_line->rfind(' ');
+    if (method_end == string_view::npos || target_end <= method_end + 1
+        || request_line->substr(target_end + 1).substr(0, 5) != "HTTP/") {
+        return nullopt;
+    }
+    req.method = request_line->substr(0, method_end);
+    string_view target = request_line->substr(method_end + 1, target_end - method_end - 1);
+    size_t query_start = target.find('?');
+    req.path = target.substr(0, query_start);
+    if (query_start != string_view::npos) {
+        req.query = target.substr(query_start + 1);
+    }
+
+    while (true) {
+        auto line = NextLine(raw);
+        if (!line) {
+            return nullopt;
+        }
+        if (line->empty()) {
+            break;
+        }
+        size_t colon = line->find(':');
+        if (colon == string_view::npos || req.header_count == HttpRequestView::MAX_HEADERS) {
+            return nullopt;
+        }
+        req.headers[req.header_count++] = {Trim(line->substr(0, colon)), Trim(line->substr(colon + 1))};
+    }
+
+    req.body = raw;
+    if (auto content_length = req.GetHeader("Content-Length")) {
+        auto length = ParseContentLength(*content_length);
+        if (!length || *length > raw.size()) {
+            return nullopt;
+        }
+        req.body = raw.substr(0, *length);
+    }
+    return req;
+}
+
+optional<string_view> GetParam(const HttpRequest& req, string_view name) {
+    auto it = req.get_params.find(string(name));
+    if (it == req.get_params.end()) {
+        return nullopt;
+    }
+    return it->second;
+}
+
+optional<string_view> GetParam(const HttpRequestView& req, string_view name) {
+    return req.GetParam(name);
 }
 
 struct LastCommentInfo {
@@ -60,6 +221,7 @@ enum class HttpCode {
     Ok = 200,
     NotFound = 404,
     Found = 302,
+    BadRequest = 400,
 };
 
 class HttpResponse {
@@ -104,6 +266,8 @@ private:
             return "Found";
         case HttpCode::NotFound:
             return "Not found";
+        case HttpCode::BadRequest:
+            return "Bad request";
         default:
             return {};
         }
@@ -116,31 +280,38 @@ private:
     std::optional<LastCommentInfo> last_comment;
     unordered_set<size_t> banned_users;
 
-    void AddUser(const HttpRequest& req, HttpResponse& resp) {
+    void AddUser(HttpResponse& resp) {
         comments_.emplace_back();
         auto user_id = to_string(comments_.size() - 1);
         resp.SetCode(HttpCode::Ok).SetContent(user_id);
     }
-    void AddComment(const HttpRequest& req, HttpResponse& resp) {
-        auto [user_id, comment] = ParseIdAndContent(req.body);
+    void AddComment(string_view body, HttpResponse& resp) {
+        auto [user_id, comment] = ParseIdAndContent(body);
+        if (!user_id || *user_id >= comments_.size()) {
+            resp.SetCode(HttpCode::BadRequest);
+            return;
+        }
 
-        if (!last_comment || last_comment->user_id != user_id) {
-            last_comment = LastCommentInfo{user_id, 1};
+        if (!last_comment || last_comment->user_id != *user_id) {
+            last_comment = LastCommentInfo{*user_id, 1};
         } else if (++last_comment->consecutive_count > 3) {
-            banned_users.insert(user_id);
+            banned_users.insert(*user_id);
         }
 
-        if (banned_users.count(user_id) == 0) {
-            comments_[user_id].push_back(comment);
+        if (banned_users.count(*user_id) == 0) {
+            comments_[*user_id].emplace_back(comment);
             resp.SetCode(HttpCode::Ok);
         } else {
             resp.SetCode(HttpCode::Found).AddHeader("Location", "/captcha");
         }
     }
-    void CheckCaptcha(const HttpRequest& req, HttpResponse& resp) {
-        if (auto [id, response] = ParseIdAndContent(req.body); response == "42") {
-            banned_users.erase(id);
-            if (last_comment && last_comment->user_id == id) {
+    void CheckCaptcha(string_view body, HttpResponse& resp) {
+        auto [id, response] = ParseIdAndContent(body);
+        if (!id || *id >= comments_.size()) {
+            resp.SetCode(HttpCode::BadRequest);
+        } else if (response == "42") {
+            banned_users.erase(*id);
+            if (last_comment && last_comment->user_id == *id) {
                 last_comment.reset();
             }
             resp.SetCode(HttpCode::Ok);
@@ -148,43 +319,65 @@ private:
             resp.SetCode(HttpCode::Found).AddHeader("Location", "/captcha");
         }
     }
-    void UserComments(const HttpRequest& req, HttpResponse& resp) {
-        auto user_id = FromString<size_t>(req.get_params.at("user_id"));
+    void UserComments(optional<string_view> user_id_param, HttpResponse& resp) {
+        optional<size_t> user_id = user_id_param ? ParseId(*user_id_param) : nullopt;
+        if (!user_id || *user_id >= comments_.size()) {
+            resp.SetCode(HttpCode::BadRequest);
+            return;
+        }
         string response;
-        for (const string& c : comments_[user_id]) {
+        for (const string& c : comments_[*user_id]) {
             response += c + '\n';
         }
         resp.SetCode(HttpCode::Ok).SetContent(response);
     }
-    void Captcha(const HttpRequest& req, HttpResponse& resp) {
+    void Captcha(HttpResponse& resp) {
         resp.SetCode(HttpCode::Ok).SetContent(
             "What's the answer for The Ultimate Question " \
             "of Life, the Universe, and Everything?");
     }
-public:
-    HttpResponse ServeRequest(const HttpRequest& req) {
+
+    // Request is HttpRequest or HttpRequestView
+    template <typename Request>
+    HttpResponse Serve(const Request& req) {
         HttpResponse resp(HttpCode::NotFound);
         if (req.method == "POST") {
             if (req.path == "/add_user") {
-                AddUser(req, resp);
+                AddUser(resp);
             } else if (req.path == "/add_comment") {
-                AddComment(req, resp);
+                AddComment(req.body, resp);
             } else if (req.path == "/checkcaptcha") {
-                CheckCaptcha(req, resp);
+                CheckCaptcha(req.body, resp);
             }
         } else if (req.method == "GET") {
             if (req.path == "/user_comments") {
-                UserComments(req, resp);
+                UserComments(GetParam(req, "user_id"), resp);
             } else if (req.path == "/captcha") {
-                Captcha(req, resp);
+                Captcha(resp);
             }
         }
         return resp;
     }
+public:
+    HttpResponse ServeRequest(const HttpRequest& req) {
+        return Serve(req);
+    }
 
     void ServeRequest(const HttpRequest& req, ostream& os) {
         os << ServeRequest(req);
     }
+
+    // Serves a request straight from the bytes read off the socket
+    HttpResponse ServeRequest(string_view raw_request) {
+        if (auto req = ParseHttpRequest(raw_request)) {
+            return Serve(*req);
+        }
+        return HttpResponse(HttpCode::BadRequest);
+    }
+
+    void ServeRequest(string_view raw_request, ostream& os) {
+        os << ServeRequest(raw_request);
+    }
 };
 
 
@@ -221,7 +414,8 @@ istream& operator >>(istream& input, ParsedResponse& r) {
     return input;
 }
 
-void Test(CommentServer& srv, const HttpRequest& request, const ParsedResponse& expected) {
+template <typename Server>
+void Test(Server& srv, const HttpRequest& request, const ParsedResponse& expected) {
     stringstream ss;
     srv.ServeRequest(request, ss);
     ParsedResponse resp;
@@ -231,6 +425,31 @@ void Test(CommentServer& srv, const HttpRequest& request, const ParsedResponse&
     ASSERT_EQUAL(resp.content, expected.content);
 }
 
+string ToRawRequest(const HttpRequest& req) {
+    string target = req.path;
+    char separator = '?';
+    for (const auto& [name, value] : req.get_params) {
+        target += separator + name + "=" + value;
+        separator = '&';
+    }
+    return req.method + " " + target + " HTTP/1.1\r\n"
+        + "Host: localhost\r\n"
+        + "Content-Length: " + to_string(req.body.size()) + "\r\n"
+        + "\r\n" + req.body;
+}
+
+// Sends every request through the raw-buffer front end of CommentServer
+class RawCommentServer {
+public:
+    void ServeRequest(const HttpRequest& req, ostream& os) {
+        const string raw = ToRawRequest(req);
+        server_.ServeRequest(string_view(raw), os);
+    }
+
+private:
+    CommentServer server_;
+};
+
 template <typename CommentServer>
 void TestServer() {
     CommentServer cs;
@@ -238,6 +457,7 @@ void TestServer() {
     const ParsedResponse ok{200};
     const ParsedResponse redirect_to_captcha{302, {{"Location", "/captcha"}}, {}};
     const ParsedResponse not_found{404};
+    const ParsedResponse bad_request{400};
 
     Test(cs, {"POST", "/add_user"}, {200, {}, "0"});
     Test(cs, {"POST", "/add_user"}, {200, {}, "1"});
@@ -272,11 +492,150 @@ void TestServer() {
         {200, {}, "Hi\nBuy my goods\nEnlarge\nSorry! No spam any more\n"}
     );
 
+    Test(cs, {"POST", "/checkcaptcha", "2 42"}, bad_request);
+    Test(cs, {"GET", "/user_comments", "", {{"user_id", "1x"}}}, bad_request);
+
     Test(cs, {"GET", "/user_commntes"}, not_found);
     Test(cs, {"POST", "/add_uesr"}, not_found);
 }
 
+void TestParseHttpRequest() {
+    const string raw =
+        "GET /user_comments?user_id=12&sort=new&flag HTTP/1.1\r\n"
+        "Host:  example.com \r\n"
+        "content-length: 5\r\n"
+        "\r\n"
+        "hello, and the next request";
+    auto req = ParseHttpRequest(raw);
+    ASSERT(req.has_value());
+    ASSERT_EQUAL(req->method, "GET");
+    ASSERT_EQUAL(req->path, "/user_comments");
+    ASSERT_EQUAL(req->query, "user_id=12&sort=new&flag");
+    ASSERT_EQUAL(req->body, "hello");
+    ASSERT_EQUAL(req->header_count, 2u);
+    ASSERT_EQUAL(*req->GetHeader("HOST"), "example.com");
+    ASSERT(!req->GetHeader("Accept").has_value());
+    ASSERT_EQUAL(*req->GetParam("user_id"), "12");
+    ASSERT_EQUAL(*req->GetParam("sort"), "new");
+    ASSERT_EQUAL(*req->GetParam("flag"), "");
+    ASSERT(!req->GetParam("user").has_value());
+
+    // Bare "\n" line ends, no Content-Length: the body is the rest
+    req = ParseHttpRequest("POST /add_comment HTTP/1.0\n\n0 Hi there");
+    ASSERT(req.has_value());
+    ASSERT_EQUAL(req->path, "/add_comment");
+    ASSERT_EQUAL(req->query, "");
+    ASSERT_EQUAL(req->body, "0 Hi there");
+
+    for (string_view bad : {
+             "",
+             "GET /\r\n\r\n",
+             "GET / HTTP/1.1\r\nHost: x\r\n",
+             "GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+             "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\nshort",
+             "POST / HTTP/1.1\r\nContent-Length: x\r\n\r\n",
+             "POST / HTTP/1.1\r\nContent-Length: 2x\r\n\r\nhi"}) {
+        ASSERT(!ParseHttpRequest(bad).has_value());
+    }
+
+    ASSERT_EQUAL(*ParseIdAndContent("12 Hello there").first, 12u);
+    ASSERT_EQUAL(ParseIdAndContent("12 Hello there").second, "Hello there");
+    ASSERT(!ParseIdAndContent("x Hello").first.has_value());
+    ASSERT(!ParseIdAndContent("").first.has_value());
+    ASSERT(!ParseIdAndContent("12abc Hello").first.has_value());
+    ASSERT(!ParseId("12 ").has_value());
+
+    CommentServer cs;
+    stringstream ss;
+    cs.ServeRequest(string_view("garbage"), ss);
+    ParsedResponse resp;
+    ss >> resp;
+    ASSERT_EQUAL(resp.code, 400);
+
+    for (string_view bad_length : {"-1", "5 5", "99999999999999999999999"}) {
+        stringstream out;
+        cs.ServeRequest(
+            "POST /add_user HTTP/1.1\r\nContent-Length: " + string(bad_length) + "\r\n\r\n", out);
+        ParsedResponse bad_resp;
+        out >> bad_resp;
+        ASSERT_EQUAL(bad_resp.code, 400);
+    }
+}
+
+// Counts every heap allocation in the program; only read by the test below
+size_t allocation_count = 0;
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    if (void* p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void TestParsingDoesNotAllocate() {
+    const string raw =
+        "POST /add_comment?user_id=7 HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Content-Length: 16\r\n"
+        "\r\n"
+        "7 Buy my goods!!";
+
+    const size_t allocations_before = allocation_count;
+    auto req = ParseHttpRequest(raw);
+    auto [id, content] = ParseIdAndContent(req->body);
+    auto param = req->GetParam("user_id");
+    auto host = req->GetHeader("host");
+    const size_t allocations = allocation_count - allocations_before;
+
+    ASSERT_EQUAL(allocations, 0u);
+    ASSERT_EQUAL(*id, 7u);
+    ASSERT_EQUAL(content, "Buy my goods!!");
+    ASSERT_EQUAL(*param, "7");
+    ASSERT_EQUAL(*host, "localhost");
+}
+
+void TestParsingSpeed() {
+    const int request_count = 1'000'000;
+    const HttpRequest request{"POST", "/add_comment", "12345 Some comment of a typical length"};
+    const string raw = ToRawRequest(request);
+
+    size_t checksum = 0;
+    {
+        LOG_DURATION("HttpRequest + SplitBy/istringstream, 1M requests");
+        for (int i = 0; i < request_count; ++i) {
+            HttpRequest copy = request;
+            auto [id_string, content] = SplitBy(copy.body, " ");
+            size_t id;
+            istringstream(id_string) >> id;
+            checksum += id + content.size();
+        }
+    }
+    size_t raw_checksum = 0;
+    {
+        LOG_DURATION("ParseHttpRequest + from_chars, 1M requests");
+        for (int i = 0; i < request_count; ++i) {
+            auto req = ParseHttpRequest(raw);
+            auto [id, content] = ParseIdAndContent(req->body);
+            raw_checksum += *id + content.size();
+        }
+    }
+    ASSERT_EQUAL(raw_checksum, checksum);
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestServer<CommentServer>);
+    RUN_TEST(tr, TestServer<RawCommentServer>);
+    RUN_TEST(tr, TestParseHttpRequest);
+    RUN_TEST(tr, TestParsingDoesNotAllocate);
+    RUN_TEST(tr, TestParsingSpeed);
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#pragma once
+
+#include "hash_combine.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Open-addressing hash set for small trivially copyable keys, laid out
+// like a Swiss table: keys sit inline in one array, and a parallel array
+// of control bytes holds 7 bits of each key's hash (or an empty/deleted
+// mark). A lookup compares 16 control bytes at once and touches keys
+// only on a 7-bit match, so misses rarely leave the control array.
+//
+// Slots are split into aligned groups of 16; probing moves from group
+// to group in triangular steps, which visits every group of a power of
+// two table.
+template <typename Key, typename Hash = hash<Key>, typename KeyEqual = equal_to<Key>>
+class FlatHashSet {
+  static_assert(is_trivially_copyable_v<Key>, "keys are moved around with memcpy");
+
+public:
+  explicit FlatHashSet(size_t capacity = 0, Hash hasher = Hash(), KeyEqual equal = KeyEqual())
+    : hasher_(move(hasher)), equal_(move(equal)) {
+    Reserve(capacity);
+  }
+
+  size_t Size() const {
+    return size_;
+  }
+
+  bool Empty() const {
+    return size_ == 0;
+  }
+
+  // Makes room for count keys without rehashing
+  void Reserve(size_t count) {
+    if (count == 0) {
+      return;
+    }
+    size_t groups = 1;
+    while (groups * GROUP_SIZE * MAX_LOAD_NUM < count * MAX_LOAD_DEN) {
+      groups *= 2;
+    }
+    if (groups * GROUP_SIZE > control_.size()) {
+      Rehash(groups);
+    }
+  }
+
+  // Returns false if the key was already there
+  bool Insert(const Key& key) {
+    const size_t hash = Mix(key);
+    if (Find(key, hash) != NOT_FOUND) {
+      return false;
+    }
+    if (size_ + deleted_ + 1 > GrowthLimit()) {
+      // Mostly tombstones: cleaning them up in place is enough
+      Rehash(size_ + 1 <= GrowthLimit() / 2 ? GroupCount() : max<size_t>(1, GroupCount() * 2));
+    }
+    const size_t slot = FindFree(hash);
+    deleted_ -= control_[slot] == DELETED;
+    SetSlot(slot, key, hash);
+    ++size_;
+    return true;
+  }
+
+  bool Contains(const Key& key) const {
+    return Find(key, Mix(key)) != NOT_FOUND;
+  }
+
+  // Returns false if there was no such key
+  bool Erase(const Key& key) {
+    const size_t slot = Find(key, Mix(key));
+    if (slot == NOT_FOUND) {
+      return false;
+    }
+    // A group that was never full can't have pushed a probe sequence
+    // past it, so its slots can go straight back to empty
+    const size_t group = slot / GROUP_SIZE * GROUP_SIZE;
+    const bool was_full = Match(group, EMPTY) == 0;
+    control_[slot] = was_full ? DELETED : EMPTY;
+    deleted_ += was_full;
+    --size_;
+    return true;
+  }
+
+  void Clear() {
+    fill(control_.begin(), control_.end(), EMPTY);
+    size_ = 0;
+    deleted_ = 0;
+  }
+
+  template <typename Callback>
+  void ForEach(Callback callback) const {
+    for (size_t slot = 0; slot < control_.size(); ++slot) {
+      if (IsFull(control_[slot])) {
+        callback(keys_[slot]);
+      }
+    }
+  }
+
+private:
+  static constexpr size_t GROUP_SIZE = 16;
+  static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+  // Up to 7/8 of the slots may be taken, counting tombstones
+  static constexpr size_t MAX_LOAD_NUM = 7;
+  static constexpr size_t MAX_LOAD_DEN = 8;
+
+  // Full slots store the low 7 bits of the hash, so they are never negative
+  static constexpr int8_t EMPTY = -128;
+  static constexpr int8_t DELETED = -2;
+
+  Hash hasher_;
+  KeyEqual equal_;
+  vector<int8_t> control_;
+  vector<Key> keys_;
+  size_t size_ = 0;
+  size_t deleted_ = 0;
+
+private:
+  static bool IsFull(int8_t control) {
+    return control >= 0;
+  }
+
+  // The user's hash may leave structure in its bits (the Point3D
+  // polynomial hash is a multiple of the lattice step), while groups are
+  // picked by the high bits and control bytes take the low ones
+  size_t Mix(const Key& key) const {
+    return hash_combine_detail::Mum(static_cast<uint64_t>(hasher_(key)) ^ hash_combine_detail::SEED,
+                                    hash_combine_detail::PRIME1);
+  }
+
+  static int8_t Tag(size_t hash) {
+    return static_cast<int8_t>(hash & 0x7f);
+  }
+
+  size_t GroupCount() const {
+    return control_.size() / GROUP_SIZE;
+  }
+
+  size_t GrowthLimit() const {
+    return control_.size() / MAX_LOAD_DEN * MAX_LOAD_NUM;
+  }
+
+  size_t FirstGroup(size_t hash) const {
+    return (hash >> 7) & (GroupCount() - 1);
+  }
+
+  // Bit i is set when control byte i of the group equals value
+  uint32_t Match(size_t group_start, int8_t value) const {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control_.data() + group_start));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_SIZE; ++i) {
+      mask |= static_cast<uint32_t>(control_[group_start + i] == value) << i;
+    }
+    return mask;
+#endif
+  }
+
+  // Bit i is set when slot i of the group is empty or deleted
+  uint32_t MatchFree(size_t group_start) const {
+#if defined(__SSE2__)
+    // Both marks are negative, full slots are not
+    __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control_.data() + group_start));
+    return _mm_movemask_epi8(group);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GROUP_SIZE; ++i) {
+      mask |= static_cast<uint32_t>(!IsFull(control_[group_start + i])) << i;
+    }
+    return mask;
+#endif
+  }
+
+  size_t Find(const Key& key, size_t hash) const {
+    if (control_.empty()) {
+      return NOT_FOUND;
+    }
+    const int8_t tag = Tag(hash);
+    const size_t group_mask = GroupCount() - 1;
+    size_t group = FirstGroup(hash);
+    for (size_t step = 1; step <= GroupCount(); ++step) {
+      const size_t start = group * GROUP_SIZE;
+      for (uint32_t match = Match(start, tag); match != 0; match &= match - 1) {
+        const size_t slot = start + __builtin_ctz(match);
+        if (equal_(keys_[slot], key)) {
+          return slot;
+        }
+      }
+      // An empty slot ends the probe sequence: the key would have gone there
+      if (Match(start, EMPTY) != 0) {
+        return NOT_FOUND;
+      }
+      group = (group + step) & group_mask;
+    }
+    return NOT_FOUND;
+  }
+
+  size_t FindFree(size_t hash) const {
+    const size_t group_mask = GroupCount() - 1;
+    size_t group = FirstGroup(hash);
+    for (size_t step = 1;; ++step) {
+      const size_t start = group * GROUP_SIZE;
+      if (uint32_t free = MatchFree(start)) {
+        return start + __builtin_ctz(free);
+      }
+      group = (group + step) & group_mask;
+    }
+  }
+
+  void SetSlot(size_t slot, const Key& key, size_t hash) {
+    control_[slot] = Tag(hash);
+    memcpy(&keys_[slot], &key, sizeof(Key));
+  }
+
+  void Rehash(size_t group_count) {
+    vector<int8_t> old_control(group_count * GROUP_SIZE, EMPTY);
+    vector<Key> old_keys(group_count * GROUP_SIZE);
+    swap(control_, old_control);
+    swap(keys_, old_keys);
+    deleted_ = 0;
+    for (size_t slot = 0; slot < old_control.size(); ++slot) {
+      if (IsFull(old_control[slot])) {
+        const size_t hash = Mix(old_keys[slot]);
+        SetSlot(FindFree(hash), old_keys[slot], hash);
+      }
+    }
+  }
+};
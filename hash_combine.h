@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+using namespace std;
+
+// Hashing for composite keys: feed the fields to a HashCombiner one by
+// one and call Finish. Mixing is a 64x64->128 bit multiply folded back to
+// 64 bits, as in wyhash; strings are consumed 16 bytes per step.
+// Results are meant for hash tables only and may change between versions.
+
+namespace hash_combine_detail {
+
+constexpr uint64_t SEED = 0xa0761d6478bd642full;
+constexpr uint64_t PRIME1 = 0xe7037ed1a0b428dbull;
+constexpr uint64_t PRIME2 = 0x8ebc6af09c88c6e3ull;
+
+inline uint64_t Mum(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t Read64(const char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t Read32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t HashBytes(const char* p, size_t size, uint64_t seed) {
+  seed ^= Mum(seed ^ PRIME1, size ^ PRIME2);
+  size_t left = size;
+  while (left > 16) {
+    seed = Mum(Read64(p) ^ PRIME1, Read64(p + 8) ^ seed);
+    p += 16;
+    left -= 16;
+  }
+  uint64_t a = 0, b = 0;
+  if (left >= 8) {
+    a = Read64(p);
+    b = Read64(p + left - 8);
+  } else if (left >= 4) {
+    a = Read32(p);
+    b = Read32(p + left - 4);
+  } else if (left > 0) {
+    a = static_cast<uint64_t>(static_cast<unsigned char>(p[0])) << 16
+      | static_cast<uint64_t>(static_cast<unsigned char>(p[left / 2])) << 8
+      | static_cast<unsigned char>(p[left - 1]);
+  }
+  return Mum(a ^ PRIME1, b ^ seed);
+}
+
+}  // namespace hash_combine_detail
+
+
+class HashCombiner {
+public:
+  HashCombiner& Add(uint64_t value) {
+    state_ = hash_combine_detail::Mum(state_ ^ value, hash_combine_detail::PRIME1);
+    return *this;
+  }
+
+  template <typename Int, typename = enable_if_t<is_integral_v<Int> || is_enum_v<Int>>>
+  HashCombiner& Add(Int value) {
+    return Add(static_cast<uint64_t>(value));
+  }
+
+  // Equal doubles must hash equally, and 0.0 == -0.0
+  HashCombiner& Add(double value) {
+    if (value == 0) {
+      value = 0;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return Add(bits);
+  }
+
+  HashCombiner& Add(string_view s) {
+    state_ = hash_combine_detail::HashBytes(s.data(), s.size(), state_);
+    return *this;
+  }
+
+  HashCombiner& Add(const string& s) {
+    return Add(string_view(s));
+  }
+
+  size_t Finish() const {
+    // Final avalanche from MurmurHash3, so low and high bits are equally good
+    uint64_t h = state_;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+
+private:
+  uint64_t state_ = hash_combine_detail::SEED;
+};
+
+template <typename... Fields>
+size_t HashFields(const Fields&... fields) {
+  HashCombiner combiner;
+  (combiner.Add(fields), ...);
+  return combiner.Finish();
+}
@@ -1,6 +1,11 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "hash_combine.h"
+
+#include <deque>
 #include <limits>
 #include <random>
+#include <string_view>
 #include <unordered_set>
 
 using namespace std;
@@ -30,38 +35,131 @@ struct Person {
   }
 };
 
+// Non-owning views with the same fields, used to probe without
+// building a Person
+struct AddressView {
+  string_view city, street;
+  int building;
+
+  bool operator==(const AddressView& other) const {
+      return city == other.city &&
+             street == other.street &&
+             building == other.building;
+  }
+};
+
+struct PersonView {
+  string_view name;
+  int height;
+  double weight;
+  AddressView address;
+
+  bool operator==(const PersonView& other) const {
+      return name == other.name &&
+             height == other.height &&
+             weight == other.weight &&
+             address == other.address;
+  }
+};
+
+AddressView View(const Address& a) {
+    return {a.city, a.street, a.building};
+}
+
+PersonView View(const Person& p) {
+    return {p.name, p.height, p.weight, View(p.address)};
+}
+
+// Hash an object and its view equally
 struct AddressHasher {
+    size_t operator()(const AddressView& a) const {
+        return HashFields(a.city, a.street, a.building);
+    }
     size_t operator()(const Address& a) const {
-        size_t c = 514'229;
-        return (
-            c * c * shash(a.city) + 
-            c * shash(a.street) + 
-            ihash(a.building)
-        );
+        return (*this)(View(a));
     }
-
-    hash<string> shash;
-    hash<int> ihash;
 };
 
 struct PersonHasher {
+    size_t operator()(const PersonView& p) const {
+        return HashFields(p.name, p.height, p.weight, ahash(p.address));
+    }
     size_t operator()(const Person& p) const {
-        size_t c = 39'916'801;
-        return (
-            c * c * c * shash(p.name) +
-            c * c * ihash(p.height) +
-            c * dhash(p.weight) +
-            ahash(p.address)
-        );
+        return (*this)(View(p));
     }
 
-    hash<string> shash;
-    hash<int> ihash;
-    hash<double> dhash;
     AddressHasher ahash;
 };
 
 
+// Key with its hash computed once. Equality checks the hashes first,
+// so most mismatches are rejected without comparing strings.
+template <typename Key>
+struct HashedKey {
+    Key key;
+    size_t hash;
+
+    bool operator==(const HashedKey& other) const {
+        return hash == other.hash && key == other.key;
+    }
+};
+
+template <typename Key, typename Hasher>
+HashedKey<Key> MakeHashed(Key key, Hasher hasher = {}) {
+    size_t hash = hasher(key);
+    return {move(key), hash};
+}
+
+struct CachedHash {
+    template <typename Key>
+    size_t operator()(const HashedKey<Key>& hashed) const noexcept {
+        return hashed.hash;
+    }
+};
+
+using HashedPerson = HashedKey<PersonView>;
+
+
+// Set of persons that is probed with views. Persons are owned by a deque,
+// so the views stored in the hash table stay valid as it grows.
+class PersonSet {
+public:
+    PersonSet() = default;
+    // A copy would hold views into the persons of the original;
+    // a move takes the deque's storage along with the views into it
+    PersonSet(const PersonSet&) = delete;
+    PersonSet& operator=(const PersonSet&) = delete;
+    PersonSet(PersonSet&&) = default;
+    PersonSet& operator=(PersonSet&&) = default;
+
+    bool Insert(Person person) {
+        auto hashed = MakeHashed(View(person), PersonHasher());
+        if (keys_.count(hashed) > 0) {
+            return false;
+        }
+        const auto& stored = persons_.emplace_back(move(person));
+        keys_.insert({View(stored), hashed.hash});
+        return true;
+    }
+
+    bool Contains(const PersonView& person) const {
+        return Contains(MakeHashed(person, PersonHasher()));
+    }
+    // For callers that probe with the same person several times
+    bool Contains(const HashedPerson& person) const {
+        return keys_.count(person) > 0;
+    }
+
+    size_t Size() const {
+        return persons_.size();
+    }
+
+private:
+    deque<Person> persons_;
+    unordered_set<HashedPerson, CachedHash> keys_;
+};
+
+
 // http://www.freebsd.org/cgi/cvsweb.cgi/~checkout~/src/share/dict/propernames
 const vector<string> WORDS = {
   "Kieran", "Jong", "Jisheng", "Vickie", "Adam", "Simon", "Lance",
@@ -108,7 +206,31 @@ void TestPurity() {
   }
 };
 
-void TestDistribution() {
+// The previous polynomial hashers, kept as a baseline for the benchmarks
+struct PolynomialAddressHasher {
+    size_t operator()(const Address& a) const {
+        size_t c = 514'229;
+        return c * c * shash(a.city) + c * shash(a.street) + ihash(a.building);
+    }
+
+    hash<string> shash;
+    hash<int> ihash;
+};
+
+struct PolynomialPersonHasher {
+    size_t operator()(const Person& p) const {
+        size_t c = 39'916'801;
+        return c * c * c * shash(p.name) + c * c * ihash(p.height) +
+               c * dhash(p.weight) + ahash(p.address);
+    }
+
+    hash<string> shash;
+    hash<int> ihash;
+    hash<double> dhash;
+    PolynomialAddressHasher ahash;
+};
+
+vector<Person> GeneratePersons(size_t count) {
   auto seed = 42;
   mt19937 gen(seed);
 
@@ -117,33 +239,165 @@ void TestDistribution() {
   uniform_int_distribution<int> building_dist(1, 300);
   uniform_int_distribution<int> word_dist(0, WORDS.size() - 1);
 
-  PersonHasher hasher;
-
-  const size_t num_buckets = 2053;
-
-  const size_t perfect_bucket_size = 50;
-  const size_t num_points = num_buckets * perfect_bucket_size;
-  vector<size_t> buckets(num_buckets);
-  for (size_t t = 0; t < num_points; ++t) {
-    Person person;
+  vector<Person> persons(count);
+  for (auto& person : persons) {
     person.name = WORDS[word_dist(gen)];
     person.height = height_dist(gen);
     person.weight = weight_dist(gen) * 0.5;
     person.address.city = WORDS[word_dist(gen)];
     person.address.street = WORDS[word_dist(gen)];
     person.address.building = building_dist(gen);
-    ++buckets[hasher(person) % num_buckets];
+  }
+  return persons;
+}
+
+// https://en.wikipedia.org/wiki/Pearson's_chi-squared_test
+template <typename Hasher, typename Bucket>
+double PearsonStat(const vector<Person>& persons, size_t num_buckets, Bucket bucket) {
+  Hasher hasher;
+  vector<size_t> buckets(num_buckets);
+  for (const auto& person : persons) {
+    ++buckets[bucket(hasher(person)) % num_buckets];
   }
 
+  const double perfect_bucket_size = persons.size() / static_cast<double>(num_buckets);
   double pearson_stat = 0;
   for (auto bucket_size : buckets) {
-    size_t size_diff = bucket_size - perfect_bucket_size;
-    pearson_stat +=
-        size_diff * size_diff / static_cast<double>(perfect_bucket_size);
+    double size_diff = bucket_size - perfect_bucket_size;
+    pearson_stat += size_diff * size_diff / perfect_bucket_size;
+  }
+  return pearson_stat;
+}
+
+void TestDistribution() {
+  const size_t perfect_bucket_size = 50;
+  const auto identity = [](size_t h) { return h; };
+  const auto high_bits = [](size_t h) { return h >> 53; };
+
+  // Prime bucket count, as in libstdc++ unordered containers
+  {
+    const size_t num_buckets = 2053;
+    auto persons = GeneratePersons(num_buckets * perfect_bucket_size);
+    const double critical_value = 2158.4981036918693;
+    ASSERT(PearsonStat<PersonHasher>(persons, num_buckets, identity) < critical_value);
   }
+  // Power of two bucket counts see only the low or only the high bits,
+  // as in open addressing tables
+  {
+    const size_t num_buckets = 2048;
+    auto persons = GeneratePersons(num_buckets * perfect_bucket_size);
+    const double critical_value = 2153.369286325719;
+    ASSERT(PearsonStat<PersonHasher>(persons, num_buckets, identity) < critical_value);
+    ASSERT(PearsonStat<PersonHasher>(persons, num_buckets, high_bits) < critical_value);
+  }
+}
+
+void TestDistributionComparison() {
+  const size_t num_buckets = 2048;
+  auto persons = GeneratePersons(num_buckets * 50);
+  const auto low_bits = [](size_t h) { return h; };
+  const auto high_bits = [](size_t h) { return h >> 53; };
+
+  cerr << "Pearson statistic over 2048 buckets (critical value 2153):" << endl
+       << "  polynomial, low bits:  "
+       << PearsonStat<PolynomialPersonHasher>(persons, num_buckets, low_bits) << endl
+       << "  polynomial, high bits: "
+       << PearsonStat<PolynomialPersonHasher>(persons, num_buckets, high_bits) << endl
+       << "  combined, low bits:    "
+       << PearsonStat<PersonHasher>(persons, num_buckets, low_bits) << endl
+       << "  combined, high bits:   "
+       << PearsonStat<PersonHasher>(persons, num_buckets, high_bits) << endl;
+}
+
+template <typename Hasher>
+void RunHashThroughput(const string& title, const vector<Person>& persons) {
+  Hasher hasher;
+  size_t sum = 0;
+  {
+    LOG_DURATION(title);
+    for (int round = 0; round < 10; ++round) {
+      for (const auto& person : persons) {
+        sum += hasher(person);
+      }
+    }
+  }
+  // Keeps the loop from being optimized away
+  ASSERT(sum != 1);
+}
+
+void TestHashThroughput() {
+  auto persons = GeneratePersons(1'000'000);
+  RunHashThroughput<PolynomialPersonHasher>("Polynomial hasher, 10M persons", persons);
+  RunHashThroughput<PersonHasher>("Combined hasher, 10M persons", persons);
+}
+
+void TestNegativeZeroWeight() {
+  Person person = {"John", 180, 0.0, {"London", "Baker St", 221}};
+  Person other = person;
+  other.weight = -0.0;
+  ASSERT(person == other);
+  ASSERT_EQUAL(PersonHasher()(person), PersonHasher()(other));
+}
+
+void TestPersonSet() {
+  PersonSet persons;
+  ASSERT(persons.Insert({"John", 180, 82.5, {"London", "Baker St", 221}}));
+  ASSERT(persons.Insert({"Sherlock", 190, 75.3, {"London", "Baker St", 221}}));
+  ASSERT(!persons.Insert({"John", 180, 82.5, {"London", "Baker St", 221}}));
+  ASSERT(persons.Insert({"John", 180, 82.5, {"London", "Baker St", 222}}));
+  ASSERT_EQUAL(persons.Size(), 3u);
 
-  const double critical_value = 2158.4981036918693;
-  ASSERT(pearson_stat < critical_value);
+  ASSERT(persons.Contains(PersonView{"John", 180, 82.5, {"London", "Baker St", 221}}));
+  ASSERT(!persons.Contains(PersonView{"John", 181, 82.5, {"London", "Baker St", 221}}));
+
+  // Views and owning objects hash equally
+  Person person = {"Sherlock", 190, 75.3, {"London", "Baker St", 221}};
+  ASSERT_EQUAL(PersonHasher()(person), PersonHasher()(View(person)));
+  auto hashed = MakeHashed(View(person), PersonHasher());
+  ASSERT(persons.Contains(hashed));
+
+  // Many inserts move nothing the table points to
+  for (size_t i = 0; i < 10'000; ++i) {
+    persons.Insert({WORDS[i % WORDS.size()], static_cast<int>(i), 60.0, {"Paris", "Rue", 1}});
+  }
+  ASSERT(persons.Contains(hashed));
+  ASSERT(persons.Contains(PersonView{WORDS[42], 42, 60.0, {"Paris", "Rue", 1}}));
+}
+
+void TestPersonSetSpeed() {
+  auto persons = GeneratePersons(1'000'000);
+
+  unordered_set<Person, PersonHasher> person_set;
+  PersonSet hashed_set;
+  for (size_t i = 0; i < persons.size(); i += 2) {
+    person_set.insert(persons[i]);
+    hashed_set.Insert(persons[i]);
+  }
+
+  // Probes come as views over some external buffer, like parsed input
+  vector<PersonView> probes;
+  for (const auto& person : persons) {
+    probes.push_back(View(person));
+  }
+
+  size_t found = 0, hashed_found = 0;
+  {
+    LOG_DURATION("unordered_set<Person>, 1M probes");
+    for (const auto& probe : probes) {
+      Person person{string(probe.name), probe.height, probe.weight,
+                    {string(probe.address.city), string(probe.address.street),
+                     probe.address.building}};
+      found += person_set.count(person);
+    }
+  }
+  {
+    LOG_DURATION("PersonSet, 1M probes");
+    for (const auto& probe : probes) {
+      hashed_found += hashed_set.Contains(probe);
+    }
+  }
+  ASSERT_EQUAL(hashed_found, found);
+  ASSERT_EQUAL(hashed_set.Size(), person_set.size());
 }
 
 int main() {
@@ -151,6 +405,11 @@ int main() {
   RUN_TEST(tr, TestSmoke);
   RUN_TEST(tr, TestPurity);
   RUN_TEST(tr, TestDistribution);
+  RUN_TEST(tr, TestNegativeZeroWeight);
+  RUN_TEST(tr, TestDistributionComparison);
+  RUN_TEST(tr, TestHashThroughput);
+  RUN_TEST(tr, TestPersonSet);
+  RUN_TEST(tr, TestPersonSetSpeed);
 
   return 0;
 }
\ No newline at end of file
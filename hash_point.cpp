@@ -1,7 +1,22 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "hash_combine.h"
+#include "flat_hash_set.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
 #include <limits>
 #include <random>
+#include <stdexcept>
+#include <unordered_map>
 #include <unordered_set>
+#include <tuple>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -30,6 +45,575 @@ struct Hasher {
     hash<CoordType> coord_hasher;
 };
 
+// Batch hashing: out[i] = Hasher{}(point i), for whole point clouds at
+// once. Hasher needs two 64-bit multiplies per point, which x86 only has
+// as a scalar instruction; SIMD has to build them out of 32x32 bit ones.
+// That only pays off with eight points per AVX2 step on x/y/z arrays, so
+// points stored as structs, and CPUs without AVX2, take the scalar loop.
+namespace point_hash_detail {
+
+inline void HashScalar(const Point3D* points, size_t count, size_t* out) {
+    Hasher hasher;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = hasher(points[i]);
+    }
+}
+
+inline void HashScalar(const CoordType* xs, const CoordType* ys, const CoordType* zs,
+                       size_t count, size_t* out) {
+    Hasher hasher;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = hasher({xs[i], ys[i], zs[i]});
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define POINT_HASH_HAS_AVX2 1
+
+constexpr uint64_t COEF = 2'946'901;
+constexpr uint64_t COEF_SQ = COEF * COEF;
+
+// Low 64 bits of a * k in every lane, for ints sign-extended to 64 bits
+// as hash<CoordType> does: their high half is 0 or ~0, so its partial
+// product is 0 or -k_low
+__attribute__((target("avx2")))
+inline __m256i Mul64(__m256i a, uint64_t k) {
+    const __m256i k_low = _mm256_set1_epi64x(k & 0xffffffff);
+    __m256i cross = _mm256_sub_epi64(_mm256_setzero_si256(),
+                                     _mm256_and_si256(_mm256_srli_epi64(a, 32), k_low));
+    if (k >> 32) {
+        cross = _mm256_add_epi64(cross, _mm256_mul_epu32(a, _mm256_set1_epi64x(k >> 32)));
+    }
+    return _mm256_add_epi64(_mm256_mul_epu32(a, k_low), _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+inline __m256i Load4(const CoordType* coords) {
+    return _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(coords)));
+}
+
+__attribute__((target("avx2")))
+inline void HashAvx2(const CoordType* xs, const CoordType* ys, const CoordType* zs,
+                     size_t count, size_t* out) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        for (size_t half = i; half < i + 8; half += 4) {
+            __m256i h = _mm256_add_epi64(Mul64(Load4(xs + half), COEF_SQ), Mul64(Load4(ys + half), COEF));
+            h = _mm256_add_epi64(h, Load4(zs + half));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + half), h);
+        }
+    }
+    HashScalar(xs + i, ys + i, zs + i, count - i, out + i);
+}
+
+inline const bool HAS_AVX2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}();
+#endif
+
+}  // namespace point_hash_detail
+
+
+inline void HashPoints(const Point3D* points, size_t count, size_t* out) {
+    point_hash_detail::HashScalar(points, count, out);
+}
+
+// Same for coordinates stored as separate arrays
+inline void HashPoints(const CoordType* xs, const CoordType* ys, const CoordType* zs,
+                       size_t count, size_t* out) {
+    using namespace point_hash_detail;
+#ifdef POINT_HASH_HAS_AVX2
+    if (HAS_AVX2) {
+        return HashAvx2(xs, ys, zs, count, out);
+    }
+#endif
+    HashScalar(xs, ys, zs, count, out);
+}
+
+
+// Uniform grid over Point3D: space is cut into cubes of cell_size and
+// each non-empty cube keeps its points in a hash table keyed by the
+// cube's coordinates. Queries visit only the cubes that can hold an
+// answer.
+class SpatialGrid {
+public:
+    explicit SpatialGrid(CoordType cell_size) : cell_size_(cell_size) {
+        if (cell_size <= 0) {
+            throw invalid_argument("Cell size must be positive");
+        }
+    }
+
+    void Insert(const Point3D& point) {
+        cells_[CellOf(point)].push_back(point);
+        ++size_;
+    }
+
+    template <typename InputIt>
+    void Insert(InputIt range_begin, InputIt range_end) {
+        vector<pair<Point3D, Point3D>> keyed;
+        for (auto it = range_begin; it != range_end; ++it) {
+            keyed.push_back({CellOf(*it), *it});
+        }
+        // Grouping by cell first fills each cell's vector in one go
+        sort(keyed.begin(), keyed.end(), [](const auto& lhs, const auto& rhs) {
+            return tie(lhs.first.x, lhs.first.y, lhs.first.z)
+                 < tie(rhs.first.x, rhs.first.y, rhs.first.z);
+        });
+        cells_.reserve(cells_.size() + keyed.size() / 4);
+        for (size_t i = 0; i < keyed.size();) {
+            size_t run_end = i;
+            while (run_end < keyed.size() && keyed[run_end].first == keyed[i].first) {
+                ++run_end;
+            }
+            auto& cell = cells_[keyed[i].first];
+            cell.reserve(cell.size() + run_end - i);
+            for (; i < run_end; ++i) {
+                cell.push_back(keyed[i].second);
+            }
+        }
+        size_ += keyed.size();
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    vector<Point3D> WithinRadius(const Point3D& center, double radius) const {
+        // Also false for NaN
+        if (!(radius >= 0)) {
+            throw invalid_argument("Radius must be a non-negative number");
+        }
+        vector<Point3D> result;
+        const double radius_sq = radius * radius;
+        auto visit = [&](const vector<Point3D>& points) {
+            for (const auto& point : points) {
+                if (DistanceSq(center, point) <= radius_sq) {
+                    result.push_back(point);
+                }
+            }
+        };
+
+        // Cells the query box spans; when that beats the non-empty cell
+        // count, scanning all of them is cheaper than probing
+        const double box_cells = pow(2 * (floor(radius / cell_size_) + 1) + 1, 3);
+        if (box_cells > cells_.size()) {
+            for (const auto& [key, points] : cells_) {
+                visit(points);
+            }
+            return result;
+        }
+        const int64_t reach = static_cast<int64_t>(radius / cell_size_) + 1;
+        const Point3D cell = CellOf(center);
+        for (int64_t dx = -reach; dx <= reach; ++dx) {
+            for (int64_t dy = -reach; dy <= reach; ++dy) {
+                for (int64_t dz = -reach; dz <= reach; ++dz) {
+                    if (auto points = FindCell(cell, dx, dy, dz)) {
+                        visit(*points);
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    // k nearest points, closest first. Cells are visited in cubic shells
+    // around the center's cell until no unvisited point can be closer than
+    // the k-th found.
+    vector<Point3D> Nearest(const Point3D& center, size_t k) const {
+        // Max-heap of (squared distance, point) keeps the best k
+        vector<pair<double, Point3D>> best;
+        auto by_distance = [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        };
+        auto visit = [&](const vector<Point3D>& points) {
+            for (const auto& point : points) {
+                double distance_sq = DistanceSq(center, point);
+                if (best.size() < k) {
+                    best.push_back({distance_sq, point});
+                    push_heap(best.begin(), best.end(), by_distance);
+                } else if (k > 0 && distance_sq < best.front().first) {
+                    pop_heap(best.begin(), best.end(), by_distance);
+                    best.back() = {distance_sq, point};
+                    push_heap(best.begin(), best.end(), by_distance);
+                }
+            }
+        };
+
+        const Point3D cell = CellOf(center);
+        size_t visited = 0;
+        for (int64_t ring = 0; visited < size_; ++ring) {
+            // A sparse grid is cheaper to scan whole than shell by shell
+            if (pow(2 * ring + 1, 3) > cells_.size()) {
+                best.clear();
+                for (const auto& [key, points] : cells_) {
+                    visit(points);
+                }
+                break;
+            }
+            for (int64_t dx = -ring; dx <= ring; ++dx) {
+                for (int64_t dy = -ring; dy <= ring; ++dy) {
+                    bool on_face = abs(dx) == ring || abs(dy) == ring;
+                    for (int64_t dz = -ring; dz <= ring; dz += on_face ? 1 : 2 * max<int64_t>(ring, 1)) {
+                        if (auto points = FindCell(cell, dx, dy, dz)) {
+                            visit(*points);
+                            visited += points->size();
+                        }
+                    }
+                }
+            }
+            // Points beyond this shell are at least ring cells away
+            double reach = static_cast<double>(ring) * cell_size_;
+            if (best.size() == k && (k == 0 || best.front().first <= reach * reach)) {
+                break;
+            }
+        }
+
+        sort_heap(best.begin(), best.end(), by_distance);
+        vector<Point3D> result;
+        result.reserve(best.size());
+        for (const auto& [distance_sq, point] : best) {
+            result.push_back(point);
+        }
+        return result;
+    }
+
+    // Runs independent queries on thread_count threads
+    vector<vector<Point3D>> WithinRadius(const vector<Point3D>& centers, double radius,
+                                         size_t thread_count) const {
+        return RunBatch(centers, thread_count, [this, radius](const Point3D& center) {
+            return WithinRadius(center, radius);
+        });
+    }
+    vector<vector<Point3D>> Nearest(const vector<Point3D>& centers, size_t k,
+                                    size_t thread_count) const {
+        return RunBatch(centers, thread_count, [this, k](const Point3D& center) {
+            return Nearest(center, k);
+        });
+    }
+
+private:
+    CoordType cell_size_;
+    unordered_map<Point3D, vector<Point3D>, Hasher> cells_;
+    size_t size_ = 0;
+
+private:
+    static double DistanceSq(const Point3D& lhs, const Point3D& rhs) {
+        double dx = static_cast<double>(lhs.x) - rhs.x;
+        double dy = static_cast<double>(lhs.y) - rhs.y;
+        double dz = static_cast<double>(lhs.z) - rhs.z;
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    CoordType CellCoord(CoordType coord) const {
+        // Rounds towards minus infinity, so cells don't double up around 0
+        int64_t c = coord;
+        return static_cast<CoordType>(c >= 0 ? c / cell_size_ : -((-c + cell_size_ - 1) / cell_size_));
+    }
+
+    Point3D CellOf(const Point3D& point) const {
+        return {CellCoord(point.x), CellCoord(point.y), CellCoord(point.z)};
+    }
+
+    const vector<Point3D>* FindCell(const Point3D& cell, int64_t dx, int64_t dy, int64_t dz) const {
+        int64_t x = cell.x + dx, y = cell.y + dy, z = cell.z + dz;
+        const int64_t min = numeric_limits<CoordType>::min();
+        const int64_t max = numeric_limits<CoordType>::max();
+        if (x < min || x > max || y < min || y > max || z < min || z > max) {
+            return nullptr;
+        }
+        auto it = cells_.find({static_cast<CoordType>(x), static_cast<CoordType>(y),
+                               static_cast<CoordType>(z)});
+        return it == cells_.end() ? nullptr : &it->second;
+    }
+
+    template <typename Query>
+    static vector<vector<Point3D>> RunBatch(const vector<Point3D>& centers,
+                                            size_t thread_count, Query query) {
+        vector<vector<Point3D>> results(centers.size());
+        thread_count = max<size_t>(1, min(thread_count, centers.size()));
+        const size_t chunk = (centers.size() + thread_count - 1) / thread_count;
+        vector<future<void>> futures;
+        for (size_t begin = 0; begin < centers.size(); begin += chunk) {
+            size_t end = min(begin + chunk, centers.size());
+            futures.push_back(async(launch::async, [&, begin, end] {
+                for (size_t i = begin; i < end; ++i) {
+                    results[i] = query(centers[i]);
+                }
+            }));
+        }
+        for (auto& f : futures) {
+            f.get();
+        }
+        return results;
+    }
+};
+
+
+// Morton (Z-order) code: the bits of x, y and z interleaved, x lowest.
+// Coordinates are biased to unsigned first, so along every axis codes
+// order the same way as coordinates; 96 bits hold the whole int range.
+using MortonCode = __uint128_t;
+
+namespace morton_detail {
+
+// Every third bit of the low 63
+constexpr uint64_t SPREAD_MASK = 0x1249249249249249ull;
+constexpr uint32_t LOW_BITS = 21;
+constexpr uint32_t SIGN_BIAS = 0x80000000u;
+
+inline uint64_t Spread(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & SPREAD_MASK;
+    return v;
+}
+
+inline uint64_t Compact(uint64_t v) {
+    v &= SPREAD_MASK;
+    v = (v ^ (v >> 2)) & 0x10c30c30c30c30c3ull;
+    v = (v ^ (v >> 4)) & 0x100f00f00f00f00full;
+    v = (v ^ (v >> 8)) & 0x1f0000ff0000ffull;
+    v = (v ^ (v >> 16)) & 0x1f00000000ffffull;
+    v = (v ^ (v >> 32)) & 0x1fffff;
+    return v;
+}
+
+// The 96-bit code is split at bit 63: low 21 bits of every coordinate
+// below, the remaining 11 above
+inline MortonCode EncodePortable(uint32_t x, uint32_t y, uint32_t z) {
+    uint64_t low = Spread(x) | Spread(y) << 1 | Spread(z) << 2;
+    uint64_t high = Spread(x >> LOW_BITS) | Spread(y >> LOW_BITS) << 1 | Spread(z >> LOW_BITS) << 2;
+    return static_cast<MortonCode>(high) << 63 | low;
+}
+
+inline uint32_t DecodePortable(MortonCode code, int axis) {
+    uint64_t low = static_cast<uint64_t>(code) & ((1ull << 63) - 1);
+    uint64_t high = static_cast<uint64_t>(code >> 63);
+    return Compact(low >> axis) | Compact(high >> axis) << LOW_BITS;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MORTON_HAS_BMI2_PATH 1
+
+__attribute__((target("bmi2")))
+inline MortonCode EncodeBmi2(uint32_t x, uint32_t y, uint32_t z) {
+    uint64_t low = _pdep_u64(x, SPREAD_MASK)
+                 | _pdep_u64(y, SPREAD_MASK << 1)
+                 | _pdep_u64(z, SPREAD_MASK << 2);
+    uint64_t high = _pdep_u64(x >> LOW_BITS, SPREAD_MASK)
+                  | _pdep_u64(y >> LOW_BITS, SPREAD_MASK << 1)
+                  | _pdep_u64(z >> LOW_BITS, SPREAD_MASK << 2);
+    return static_cast<MortonCode>(high) << 63 | low;
+}
+
+__attribute__((target("bmi2")))
+inline uint32_t DecodeBmi2(MortonCode code, int axis) {
+    uint64_t low = static_cast<uint64_t>(code);
+    uint64_t high = static_cast<uint64_t>(code >> 63);
+    return _pext_u64(low, (SPREAD_MASK << axis) & ((1ull << 63) - 1))
+         | _pext_u64(high, SPREAD_MASK << axis) << LOW_BITS;
+}
+
+// Checked once; the branch on it is free next to the work it guards
+inline const bool HAS_BMI2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("bmi2") != 0;
+}();
+#endif
+
+// Bits of one axis
+inline MortonCode AxisMask(int axis) {
+    return (static_cast<MortonCode>(SPREAD_MASK) << 63 | SPREAD_MASK) << axis;
+}
+
+}  // namespace morton_detail
+
+
+inline MortonCode MortonEncode(const Point3D& p) {
+    using namespace morton_detail;
+    uint32_t x = static_cast<uint32_t>(p.x) ^ SIGN_BIAS;
+    uint32_t y = static_cast<uint32_t>(p.y) ^ SIGN_BIAS;
+    uint32_t z = static_cast<uint32_t>(p.z) ^ SIGN_BIAS;
+#ifdef MORTON_HAS_BMI2_PATH
+    if (HAS_BMI2) {
+        return EncodeBmi2(x, y, z);
+    }
+#endif
+    return EncodePortable(x, y, z);
+}
+
+inline Point3D MortonDecode(MortonCode code) {
+    using namespace morton_detail;
+    auto decode = [code](int axis) {
+#ifdef MORTON_HAS_BMI2_PATH
+        if (HAS_BMI2) {
+            return static_cast<CoordType>(DecodeBmi2(code, axis) ^ SIGN_BIAS);
+        }
+#endif
+        return static_cast<CoordType>(DecodePortable(code, axis) ^ SIGN_BIAS);
+    };
+    return {decode(0), decode(1), decode(2)};
+}
+
+// Smallest code greater than `code` whose point lies in the box with
+// corner codes low and high (BIGMIN from Tropf and Herzog, 1981).
+// `code` must be inside [low, high] but outside the box.
+inline MortonCode MortonNextInBox(MortonCode code, MortonCode low, MortonCode high) {
+    MortonCode next = 0;
+    for (int bit = 95; bit >= 0; --bit) {
+        const MortonCode mask = static_cast<MortonCode>(1) << bit;
+        const MortonCode below = morton_detail::AxisMask(bit % 3) & (mask - 1);
+        const bool c = code & mask, lo = low & mask, hi = high & mask;
+        if (!c && !lo && hi) {
+            // The box splits here: its upper half starts at `next`, the
+            // lower half is where `code` continues
+            next = (low & ~below) | mask;
+            high = (high & ~mask) | below;
+        } else if (!c && lo && hi) {
+            return low;
+        } else if (c && !lo && !hi) {
+            return next;
+        } else if (c && !lo && hi) {
+            low = (low & ~below) | mask;
+        }
+    }
+    return next;
+}
+
+// Encoding is a bijection, so distinct points only collide in the final
+// 128 to 64 bit multiply fold
+struct MortonHasher {
+    size_t operator()(const Point3D& p) const {
+        using namespace hash_combine_detail;
+        MortonCode code = MortonEncode(p);
+        return Mum(static_cast<uint64_t>(code) ^ PRIME1, static_cast<uint64_t>(code >> 64) ^ SEED);
+    }
+};
+
+
+// Points kept sorted by Morton code in one flat array: points close in
+// space are mostly close in memory, and a box query becomes a scan of
+// the code interval between its corners that skips the stretches where
+// the curve leaves the box.
+class MortonPointSet {
+public:
+    MortonPointSet() = default;
+
+    template <typename InputIt>
+    MortonPointSet(InputIt range_begin, InputIt range_end) {
+        Insert(range_begin, range_end);
+    }
+
+    void Insert(const Point3D& point) {
+        Entry entry{MortonEncode(point), point};
+        entries_.insert(upper_bound(entries_.begin(), entries_.end(), entry, ByCode), entry);
+    }
+
+    template <typename InputIt>
+    void Insert(InputIt range_begin, InputIt range_end) {
+        const size_t old_size = entries_.size();
+        for (auto it = range_begin; it != range_end; ++it) {
+            entries_.push_back({MortonEncode(*it), *it});
+        }
+        sort(entries_.begin() + old_size, entries_.end(), ByCode);
+        inplace_merge(entries_.begin(), entries_.begin() + old_size, entries_.end(), ByCode);
+    }
+
+    size_t Size() const {
+        return entries_.size();
+    }
+
+    bool Contains(const Point3D& point) const {
+        const MortonCode code = MortonEncode(point);
+        auto it = lower_bound(entries_.begin(), entries_.end(), code, CodeBelow);
+        return it != entries_.end() && it->code == code;
+    }
+
+    // Points with low.x <= x <= high.x and so on for y and z
+    vector<Point3D> InBox(const Point3D& low, const Point3D& high) const {
+        vector<Point3D> result;
+        if (low.x > high.x || low.y > high.y || low.z > high.z) {
+            return result;
+        }
+        auto inside = [&](const Point3D& p) {
+            return low.x <= p.x && p.x <= high.x
+                && low.y <= p.y && p.y <= high.y
+                && low.z <= p.z && p.z <= high.z;
+        };
+
+        const MortonCode low_code = MortonEncode(low);
+        const MortonCode high_code = MortonEncode(high);
+        auto it = lower_bound(entries_.begin(), entries_.end(), low_code, CodeBelow);
+        while (it != entries_.end() && it->code <= high_code) {
+            if (inside(it->point)) {
+                result.push_back(it->point);
+                ++it;
+                continue;
+            }
+            // Short excursions are cheaper to walk than to jump over
+            size_t steps = 0;
+            while (steps < LINEAR_PROBE && it != entries_.end() && it->code <= high_code
+                   && !inside(it->point)) {
+                ++it;
+                ++steps;
+            }
+            if (steps == LINEAR_PROBE && it != entries_.end() && it->code <= high_code
+                && !inside(it->point)) {
+                MortonCode next = MortonNextInBox(it->code, low_code, high_code);
+                it = lower_bound(it, entries_.end(), next, CodeBelow);
+            }
+        }
+        return result;
+    }
+
+    vector<Point3D> WithinRadius(const Point3D& center, double radius) const {
+        if (radius < 0) {
+            return {};
+        }
+        auto clamp_coord = [](double coord) {
+            return static_cast<CoordType>(clamp<double>(coord,
+                numeric_limits<CoordType>::min(), numeric_limits<CoordType>::max()));
+        };
+        Point3D low = {clamp_coord(floor(center.x - radius)), clamp_coord(floor(center.y - radius)),
+                       clamp_coord(floor(center.z - radius))};
+        Point3D high = {clamp_coord(ceil(center.x + radius)), clamp_coord(ceil(center.y + radius)),
+                        clamp_coord(ceil(center.z + radius))};
+
+        vector<Point3D> result = InBox(low, high);
+        const double radius_sq = radius * radius;
+        result.erase(remove_if(result.begin(), result.end(), [&](const Point3D& p) {
+            double dx = static_cast<double>(p.x) - center.x;
+            double dy = static_cast<double>(p.y) - center.y;
+            double dz = static_cast<double>(p.z) - center.z;
+            return dx * dx + dy * dy + dz * dz > radius_sq;
+        }), result.end());
+        return result;
+    }
+
+private:
+    struct Entry {
+        MortonCode code;
+        Point3D point;
+    };
+
+    static constexpr size_t LINEAR_PROBE = 8;
+
+    vector<Entry> entries_;
+
+private:
+    static bool ByCode(const Entry& lhs, const Entry& rhs) {
+        return lhs.code < rhs.code;
+    }
+
+    static bool CodeBelow(const Entry& entry, MortonCode code) {
+        return entry.code < code;
+    }
+};
+
 
 void TestSmoke() {
     vector<Point3D> points = {
@@ -133,6 +717,7 @@ void TestZ()
     ASSERT(component_matters);
 }
 
+template <typename PointHasher>
 void TestDistribution()
 {
     auto seed = 42;
@@ -141,7 +726,7 @@ void TestDistribution()
         numeric_limits<CoordType>::min(),
         numeric_limits<CoordType>::max());
 
-    Hasher hasher;
+    PointHasher hasher;
 
     const size_t num_buckets = 2053;
     const size_t perfect_bucket_size = 50;
@@ -166,6 +751,447 @@ void TestDistribution()
     ASSERT(pearson_stat < critical_value);
 }
 
+ostream& operator<<(ostream& os, const Point3D& p) {
+    return os << '(' << p.x << ", " << p.y << ", " << p.z << ')';
+}
+
+vector<Point3D> RandomPoints(size_t count, CoordType range, int seed) {
+    mt19937 gen(seed);
+    uniform_int_distribution<CoordType> dist(-range, range);
+    vector<Point3D> points(count);
+    for (auto& point : points) {
+        point = {dist(gen), dist(gen), dist(gen)};
+    }
+    return points;
+}
+
+double DistanceSq(const Point3D& lhs, const Point3D& rhs) {
+    double dx = static_cast<double>(lhs.x) - rhs.x;
+    double dy = static_cast<double>(lhs.y) - rhs.y;
+    double dz = static_cast<double>(lhs.z) - rhs.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+vector<double> SortedDistances(const Point3D& center, const vector<Point3D>& points) {
+    vector<double> distances;
+    for (const auto& point : points) {
+        distances.push_back(DistanceSq(center, point));
+    }
+    sort(distances.begin(), distances.end());
+    return distances;
+}
+
+void TestSpatialGrid() {
+    auto points = RandomPoints(20'000, 1000, 42);
+    SpatialGrid grid(50);
+    grid.Insert(points.begin(), points.begin() + 10'000);
+    for (size_t i = 10'000; i < points.size(); ++i) {
+        grid.Insert(points[i]);
+    }
+    ASSERT_EQUAL(grid.Size(), points.size());
+
+    auto centers = RandomPoints(50, 1200, 7);
+    for (const auto& center : centers) {
+        for (double radius : {0.0, 30.0, 120.0, 500.0}) {
+            vector<Point3D> expected;
+            copy_if(points.begin(), points.end(), back_inserter(expected),
+                [&](const Point3D& p) { return DistanceSq(center, p) <= radius * radius; });
+            ASSERT_EQUAL(SortedDistances(center, grid.WithinRadius(center, radius)),
+                         SortedDistances(center, expected));
+        }
+        for (size_t k : {0u, 1u, 10u, 100u}) {
+            auto expected = SortedDistances(center, points);
+            expected.resize(k);
+            ASSERT_EQUAL(SortedDistances(center, grid.Nearest(center, k)), expected);
+        }
+    }
+
+    auto batch = grid.Nearest(centers, 5, 4);
+    for (size_t i = 0; i < centers.size(); ++i) {
+        ASSERT_EQUAL(SortedDistances(centers[i], batch[i]),
+                     SortedDistances(centers[i], grid.Nearest(centers[i], 5)));
+    }
+}
+
+void TestSpatialGridExtremeCoords() {
+    const CoordType min = numeric_limits<CoordType>::min();
+    const CoordType max = numeric_limits<CoordType>::max();
+    vector<Point3D> points = {{min, min, min}, {max, max, max}, {0, 0, 0}, {-1, -1, -1}};
+    SpatialGrid grid(1000);
+    grid.Insert(points.begin(), points.end());
+
+    ASSERT_EQUAL(grid.Nearest({min, min, min}, 1), vector<Point3D>({{min, min, min}}));
+    ASSERT_EQUAL(grid.Nearest({max, max, max}, 1), vector<Point3D>({{max, max, max}}));
+    ASSERT_EQUAL(grid.WithinRadius({0, 0, 0}, 2).size(), 2u);
+}
+
+void TestSpatialGridBadArguments() {
+    for (CoordType cell_size : {0, -10}) {
+        try {
+            SpatialGrid grid(cell_size);
+            ASSERT(false);
+        } catch (const invalid_argument&) {
+        }
+    }
+
+    SpatialGrid grid(10);
+    grid.Insert({1, 2, 3});
+    for (double radius : {-1.0, numeric_limits<double>::quiet_NaN()}) {
+        try {
+            grid.WithinRadius({0, 0, 0}, radius);
+            ASSERT(false);
+        } catch (const invalid_argument&) {
+        }
+    }
+}
+
+void TestSpatialGridSpeed() {
+    auto points = RandomPoints(1'000'000, 100'000, 42);
+    auto centers = RandomPoints(200, 100'000, 7);
+
+    SpatialGrid grid(2000);
+    {
+        LOG_DURATION("Grid bulk insert, 1M points");
+        grid.Insert(points.begin(), points.end());
+    }
+    size_t brute_found = 0, grid_found = 0;
+    {
+        LOG_DURATION("Brute force, 200 radius queries");
+        for (const auto& center : centers) {
+            for (const auto& point : points) {
+                brute_found += DistanceSq(center, point) <= 5000.0 * 5000.0;
+            }
+        }
+    }
+    {
+        LOG_DURATION("Grid, 200 radius queries");
+        for (const auto& center : centers) {
+            grid_found += grid.WithinRadius(center, 5000).size();
+        }
+    }
+    ASSERT_EQUAL(grid_found, brute_found);
+
+    auto many_centers = RandomPoints(20'000, 100'000, 8);
+    const size_t thread_count = max(1u, thread::hardware_concurrency());
+    {
+        LOG_DURATION("Grid, 20K 10-NN queries, 1 thread");
+        grid.Nearest(many_centers, 10, 1);
+    }
+    {
+        LOG_DURATION("Grid, 20K 10-NN queries, " + to_string(thread_count) + " threads");
+        grid.Nearest(many_centers, 10, thread_count);
+    }
+}
+
+void TestMortonRoundTrip() {
+    const CoordType min = numeric_limits<CoordType>::min();
+    const CoordType max = numeric_limits<CoordType>::max();
+    vector<Point3D> points = {{0, 0, 0}, {-1, -1, -1}, {min, min, min}, {max, max, max},
+                              {min, 0, max}, {1 << 21, -(1 << 21), (1 << 21) - 1}};
+    auto random_points = RandomPoints(10'000, max, 42);
+    points.insert(points.end(), random_points.begin(), random_points.end());
+
+    for (const auto& p : points) {
+        ASSERT_EQUAL(MortonDecode(MortonEncode(p)), p);
+        uint32_t x = static_cast<uint32_t>(p.x) ^ morton_detail::SIGN_BIAS;
+        uint32_t y = static_cast<uint32_t>(p.y) ^ morton_detail::SIGN_BIAS;
+        uint32_t z = static_cast<uint32_t>(p.z) ^ morton_detail::SIGN_BIAS;
+        ASSERT(MortonEncode(p) == morton_detail::EncodePortable(x, y, z));
+        ASSERT_EQUAL(morton_detail::DecodePortable(MortonEncode(p), 1), y);
+    }
+
+    ASSERT(MortonEncode({min, min, min}) == 0);
+    ASSERT(MortonEncode({max, max, max}) == (static_cast<MortonCode>(1) << 96) - 1);
+    ASSERT(MortonEncode({1, 0, 0}) - MortonEncode({0, 0, 0}) == 1);
+    ASSERT(MortonEncode({0, 1, 0}) - MortonEncode({0, 0, 0}) == 2);
+    ASSERT(MortonEncode({0, 0, 1}) - MortonEncode({0, 0, 0}) == 4);
+    // Codes order like coordinates along each axis, negatives included
+    ASSERT(MortonEncode({-5, 3, 3}) < MortonEncode({-4, 3, 3}));
+    ASSERT(MortonEncode({3, -1, 3}) < MortonEncode({3, 0, 3}));
+}
+
+void TestMortonPointSet() {
+    auto points = RandomPoints(20'000, 1000, 42);
+    MortonPointSet point_set(points.begin(), points.begin() + 15'000);
+    for (size_t i = 15'000; i < points.size(); ++i) {
+        point_set.Insert(points[i]);
+    }
+    ASSERT_EQUAL(point_set.Size(), points.size());
+    ASSERT(point_set.Contains(points[0]));
+    ASSERT(point_set.Contains(points.back()));
+    ASSERT(!point_set.Contains({5000, 0, 0}));
+
+    mt19937 gen(7);
+    uniform_int_distribution<CoordType> corner(-1100, 1100);
+    for (size_t t = 0; t < 200; ++t) {
+        Point3D a = {corner(gen), corner(gen), corner(gen)};
+        Point3D b = {corner(gen), corner(gen), corner(gen)};
+        Point3D low = {min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)};
+        Point3D high = {max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)};
+        size_t expected = count_if(points.begin(), points.end(), [&](const Point3D& p) {
+            return low.x <= p.x && p.x <= high.x && low.y <= p.y && p.y <= high.y
+                && low.z <= p.z && p.z <= high.z;
+        });
+        ASSERT_EQUAL(point_set.InBox(low, high).size(), expected);
+        ASSERT_EQUAL(point_set.InBox(high, low).size(), expected == 0 || low == high ? expected : 0u);
+    }
+
+    for (const auto& center : RandomPoints(50, 1200, 8)) {
+        for (double radius : {0.0, 30.0, 250.0}) {
+            vector<Point3D> expected;
+            copy_if(points.begin(), points.end(), back_inserter(expected),
+                [&](const Point3D& p) { return DistanceSq(center, p) <= radius * radius; });
+            ASSERT_EQUAL(SortedDistances(center, point_set.WithinRadius(center, radius)),
+                         SortedDistances(center, expected));
+        }
+    }
+
+    // Boxes around zero straddle the sign bias
+    vector<Point3D> around_zero = {{-1, -1, -1}, {0, 0, 0}, {1, 1, 1}, {-1, 1, 0}};
+    MortonPointSet small(around_zero.begin(), around_zero.end());
+    ASSERT_EQUAL(small.InBox({-1, -1, -1}, {0, 0, 0}).size(), 2u);
+    ASSERT_EQUAL(small.InBox({-1, 0, -1}, {0, 1, 0}).size(), 2u);
+}
+
+void TestMortonHasherLowBits() {
+    // On a lattice with stride 64 the polynomial hash is always a multiple
+    // of 64, which tables indexed by the low bits can't live with
+    vector<bool> seen(1 << 16);
+    MortonHasher hasher;
+    for (CoordType x = 0; x < 64; ++x) {
+        for (CoordType y = 0; y < 64; ++y) {
+            for (CoordType z = 0; z < 64; ++z) {
+                seen[hasher({x * 64, y * 64, z * 64}) & 0xffff] = true;
+            }
+        }
+    }
+    // 2^18 keys into 2^16 slots leave about e^-4 of them empty
+    ASSERT(count(seen.begin(), seen.end(), true) > 63'000);
+}
+
+void TestMortonSpeed() {
+    auto points = RandomPoints(1'000'000, 100'000, 42);
+    auto centers = RandomPoints(1000, 100'000, 7);
+
+    MortonPointSet point_set;
+    {
+        LOG_DURATION("Morton set bulk insert, 1M points");
+        point_set.Insert(points.begin(), points.end());
+    }
+    SpatialGrid grid(2000);
+    grid.Insert(points.begin(), points.end());
+
+    size_t morton_found = 0, grid_found = 0;
+    {
+        LOG_DURATION("Morton set, 1000 radius queries");
+        for (const auto& center : centers) {
+            morton_found += point_set.WithinRadius(center, 5000).size();
+        }
+    }
+    {
+        LOG_DURATION("Grid, 1000 radius queries");
+        for (const auto& center : centers) {
+            grid_found += grid.WithinRadius(center, 5000).size();
+        }
+    }
+    ASSERT_EQUAL(morton_found, grid_found);
+
+    // A dense lattice is where the polynomial hash is weakest
+    vector<Point3D> lattice;
+    for (CoordType x = 0; x < 100; ++x) {
+        for (CoordType y = 0; y < 100; ++y) {
+            for (CoordType z = 0; z < 100; ++z) {
+                lattice.push_back({x * 64, y * 64, z * 64});
+            }
+        }
+    }
+    auto fill = [&lattice](auto& point_set) {
+        for (const auto& p : lattice) {
+            point_set.insert(p);
+        }
+        size_t found = 0;
+        for (const auto& p : lattice) {
+            found += point_set.count(p);
+        }
+        return found;
+    };
+    {
+        LOG_DURATION("unordered_set<Point3D, Hasher>, 1M lattice points");
+        unordered_set<Point3D, Hasher> point_set;
+        ASSERT_EQUAL(fill(point_set), lattice.size());
+    }
+    {
+        LOG_DURATION("unordered_set<Point3D, MortonHasher>, 1M lattice points");
+        unordered_set<Point3D, MortonHasher> point_set;
+        ASSERT_EQUAL(fill(point_set), lattice.size());
+    }
+}
+
+void TestBatchHashing() {
+    const CoordType min = numeric_limits<CoordType>::min();
+    const CoordType max = numeric_limits<CoordType>::max();
+    auto points = RandomPoints(1000, max, 42);
+    points.insert(points.begin(), {{min, min, min}, {max, max, max}, {-1, 0, 1}, {min, max, -1}});
+
+    vector<CoordType> xs, ys, zs;
+    for (const auto& p : points) {
+        xs.push_back(p.x);
+        ys.push_back(p.y);
+        zs.push_back(p.z);
+    }
+    Hasher hasher;
+    // Every tail length of the vector loop
+    for (size_t count : {0u, 1u, 3u, 4u, 7u, 8u, 9u, 15u, 1004u}) {
+        vector<size_t> hashes(count), soa_hashes(count);
+        HashPoints(points.data(), count, hashes.data());
+        HashPoints(xs.data(), ys.data(), zs.data(), count, soa_hashes.data());
+        for (size_t i = 0; i < count; ++i) {
+            ASSERT_EQUAL(hashes[i], hasher(points[i]));
+            ASSERT_EQUAL(soa_hashes[i], hasher(points[i]));
+        }
+    }
+}
+
+void TestBatchHashingSpeed() {
+    // A block that stays in L1/L2, so the loops are timed rather than memory
+    const size_t block = 4096;
+    const size_t rounds = 2500;  // 10M points in total
+    auto points = RandomPoints(block, numeric_limits<CoordType>::max(), 42);
+    vector<CoordType> xs, ys, zs;
+    for (const auto& p : points) {
+        xs.push_back(p.x);
+        ys.push_back(p.y);
+        zs.push_back(p.z);
+    }
+    vector<size_t> expected(block), hashes(block);
+    {
+        LOG_DURATION("Scalar Hasher, 10M points");
+        for (size_t round = 0; round < rounds; ++round) {
+            point_hash_detail::HashScalar(points.data(), block, expected.data());
+        }
+    }
+    {
+        LOG_DURATION("Scalar Hasher on x/y/z arrays, 10M points");
+        for (size_t round = 0; round < rounds; ++round) {
+            point_hash_detail::HashScalar(xs.data(), ys.data(), zs.data(), block, hashes.data());
+        }
+    }
+    ASSERT(hashes == expected);
+    {
+        LOG_DURATION("HashPoints on x/y/z arrays, 10M points");
+        for (size_t round = 0; round < rounds; ++round) {
+            HashPoints(xs.data(), ys.data(), zs.data(), block, hashes.data());
+        }
+    }
+    ASSERT(hashes == expected);
+}
+
+void TestFlatHashSet() {
+    mt19937 gen(42);
+    // A small coordinate range makes repeats and erases of present keys common
+    uniform_int_distribution<CoordType> coord(-20, 20);
+    uniform_int_distribution<int> op(0, 2);
+
+    FlatHashSet<Point3D, Hasher> flat_set;
+    unordered_set<Point3D, Hasher> expected;
+    for (size_t t = 0; t < 200'000; ++t) {
+        Point3D point = {coord(gen), coord(gen), coord(gen)};
+        switch (op(gen)) {
+        case 0:
+            ASSERT_EQUAL(flat_set.Insert(point), expected.insert(point).second);
+            break;
+        case 1:
+            ASSERT_EQUAL(flat_set.Erase(point), expected.erase(point) == 1);
+            break;
+        default:
+            ASSERT_EQUAL(flat_set.Contains(point), expected.count(point) == 1);
+        }
+        ASSERT_EQUAL(flat_set.Size(), expected.size());
+    }
+
+    size_t visited = 0;
+    flat_set.ForEach([&](const Point3D& point) {
+        ASSERT_EQUAL(expected.count(point), 1u);
+        ++visited;
+    });
+    ASSERT_EQUAL(visited, expected.size());
+
+    flat_set.Clear();
+    ASSERT(flat_set.Empty());
+    ASSERT(!flat_set.Contains({0, 0, 0}));
+    ASSERT(flat_set.Insert({0, 0, 0}));
+}
+
+void TestFlatHashSetChurn() {
+    // Insert/erase cycles at a steady size must reuse tombstones, not grow
+    FlatHashSet<Point3D, Hasher> flat_set(1000);
+    auto points = RandomPoints(100'000, 1'000'000, 42);
+    for (size_t i = 0; i < points.size(); ++i) {
+        ASSERT(flat_set.Insert(points[i]));
+        if (i >= 1000) {
+            ASSERT(flat_set.Erase(points[i - 1000]));
+        }
+    }
+    ASSERT_EQUAL(flat_set.Size(), 1000u);
+    for (size_t i = points.size() - 1000; i < points.size(); ++i) {
+        ASSERT(flat_set.Contains(points[i]));
+    }
+}
+
+void TestFlatHashSetSpeed() {
+    const size_t count = 10'000'000;
+    const CoordType max = numeric_limits<CoordType>::max();
+    auto points = RandomPoints(count, max, 42);
+    auto misses = RandomPoints(count, max, 43);
+
+    {
+        unordered_set<Point3D, Hasher> point_set;
+        {
+            LOG_DURATION("unordered_set<Point3D, Hasher>, 10M inserts");
+            for (const auto& point : points) {
+                point_set.insert(point);
+            }
+        }
+        size_t found = 0;
+        {
+            LOG_DURATION("unordered_set<Point3D, Hasher>, 10M hits");
+            for (const auto& point : points) {
+                found += point_set.count(point);
+            }
+        }
+        {
+            LOG_DURATION("unordered_set<Point3D, Hasher>, 10M misses");
+            for (const auto& point : misses) {
+                found += point_set.count(point);
+            }
+        }
+        ASSERT_EQUAL(found, count);
+    }
+    {
+        FlatHashSet<Point3D, Hasher> point_set;
+        {
+            LOG_DURATION("FlatHashSet<Point3D, Hasher>, 10M inserts");
+            for (const auto& point : points) {
+                point_set.Insert(point);
+            }
+        }
+        size_t found = 0;
+        {
+            LOG_DURATION("FlatHashSet<Point3D, Hasher>, 10M hits");
+            for (const auto& point : points) {
+                found += point_set.Contains(point);
+            }
+        }
+        {
+            LOG_DURATION("FlatHashSet<Point3D, Hasher>, 10M misses");
+            for (const auto& point : misses) {
+                found += point_set.Contains(point);
+            }
+        }
+        ASSERT_EQUAL(found, count);
+    }
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestSmoke);
@@ -173,7 +1199,21 @@ int main() {
     RUN_TEST(tr, TestX);
     RUN_TEST(tr, TestY);
     RUN_TEST(tr, TestZ);
-    RUN_TEST(tr, TestDistribution);
+    RUN_TEST(tr, TestDistribution<Hasher>);
+    RUN_TEST(tr, TestDistribution<MortonHasher>);
+    RUN_TEST(tr, TestBatchHashing);
+    RUN_TEST(tr, TestBatchHashingSpeed);
+    RUN_TEST(tr, TestSpatialGrid);
+    RUN_TEST(tr, TestSpatialGridExtremeCoords);
+    RUN_TEST(tr, TestSpatialGridBadArguments);
+    RUN_TEST(tr, TestSpatialGridSpeed);
+    RUN_TEST(tr, TestMortonRoundTrip);
+    RUN_TEST(tr, TestMortonPointSet);
+    RUN_TEST(tr, TestMortonHasherLowBits);
+    RUN_TEST(tr, TestMortonSpeed);
+    RUN_TEST(tr, TestFlatHashSet);
+    RUN_TEST(tr, TestFlatHashSetChurn);
+    RUN_TEST(tr, TestFlatHashSetSpeed);
 
     return 0;
 }
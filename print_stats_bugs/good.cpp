@@ -1,10 +1,27 @@
 #include "test_runner.h"
+#include "profile.h"
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 using namespace std;
 
 enum class Gender {
@@ -40,6 +57,23 @@ struct AgeStats {
   int unemployed_males;
 };
 
+bool operator==(const AgeStats& lhs, const AgeStats& rhs) {
+  return lhs.total == rhs.total
+      && lhs.females == rhs.females
+      && lhs.males == rhs.males
+      && lhs.employed_females == rhs.employed_females
+      && lhs.unemployed_females == rhs.unemployed_females
+      && lhs.employed_males == rhs.employed_males
+      && lhs.unemployed_males == rhs.unemployed_males;
+}
+
+ostream& operator<<(ostream& stream, const AgeStats& stats) {
+  return stream << "AgeStats(" << stats.total
+      << ", " << stats.females << ", " << stats.males
+      << ", " << stats.employed_females << ", " << stats.unemployed_females
+      << ", " << stats.employed_males << ", " << stats.unemployed_males << ")";
+}
+
 template <typename InputIt>
 int ComputeMedianAge(InputIt range_begin, InputIt range_end) {
   if (range_begin == range_end) {
@@ -77,7 +111,359 @@ vector<Person> ReadPersons(istream& in_stream = cin) {
   return persons;
 }
 
-AgeStats ComputeStats(vector<Person> persons) {
+// Binary columnar form of the ReadPersons input:
+//   "PSB1", 4 reserved zero bytes, u64 count (little endian),
+//   count age bytes, then count flag bytes (FLAG_MALE | FLAG_EMPLOYED).
+namespace persons_binary {
+
+constexpr char MAGIC[4] = {'P', 'S', 'B', '1'};
+constexpr size_t HEADER_SIZE = 16;
+constexpr uint8_t FLAG_MALE = 1;
+constexpr uint8_t FLAG_EMPLOYED = 2;
+
+inline char Age(int age) {
+  if (age < 0 || age > 255) {
+    throw out_of_range("Age " + to_string(age) + " doesn't fit in a byte");
+  }
+  return static_cast<char>(age);
+}
+
+// Any gender but FEMALE is stored as male, the way ComputeStats counts it
+inline char Flags(Gender gender, bool is_employed) {
+  return static_cast<char>((gender == Gender::FEMALE ? 0 : FLAG_MALE)
+                           | (is_employed ? FLAG_EMPLOYED : 0));
+}
+
+// The count is spelled out byte by byte, so files move between machines
+inline void EncodeCount(uint64_t count, char* out) {
+  for (size_t i = 0; i < sizeof(count); ++i) {
+    out[i] = static_cast<char>(count >> (8 * i) & 0xff);
+  }
+}
+
+inline uint64_t DecodeCount(const uint8_t* in) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < sizeof(count); ++i) {
+    count |= static_cast<uint64_t>(in[i]) << (8 * i);
+  }
+  return count;
+}
+
+inline void Write(const string& ages, const string& flags, ostream& out_stream) {
+  char header[HEADER_SIZE] = {};
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  EncodeCount(ages.size(), header + 8);
+  out_stream.write(header, sizeof(header));
+  out_stream.write(ages.data(), ages.size());
+  out_stream.write(flags.data(), flags.size());
+  // Flushed here, so that a full disk is reported rather than lost
+  // when the stream is closed
+  if (!out_stream.flush()) {
+    throw runtime_error("Can't write persons");
+  }
+}
+
+}  // namespace persons_binary
+
+void WritePersonsBinary(const vector<Person>& persons, ostream& out_stream) {
+  string ages, flags;
+  ages.reserve(persons.size());
+  flags.reserve(persons.size());
+  for (const Person& person : persons) {
+    ages.push_back(persons_binary::Age(person.age));
+    flags.push_back(persons_binary::Flags(person.gender, person.is_employed));
+  }
+  persons_binary::Write(ages, flags, out_stream);
+}
+
+// Converts the text input of ReadPersons, two bytes per person in memory
+void ConvertPersonsToBinary(istream& text_stream, ostream& binary_stream) {
+  int person_count;
+  if (!(text_stream >> person_count) || person_count < 0) {
+    throw runtime_error("Bad person count");
+  }
+  string ages, flags;
+  ages.reserve(person_count);
+  flags.reserve(person_count);
+  for (int i = 0; i < person_count; ++i) {
+    int age, gender, is_employed;
+    if (!(text_stream >> age >> gender >> is_employed)) {
+      throw runtime_error("Can't read person " + to_string(i));
+    }
+    ages.push_back(persons_binary::Age(age));
+    flags.push_back(persons_binary::Flags(static_cast<Gender>(gender), is_employed == 1));
+  }
+  persons_binary::Write(ages, flags, binary_stream);
+}
+
+// Read-only view of a binary persons file, mapped into memory. Persons
+// are decoded from the two columns on access; nothing is copied.
+class PersonsView {
+public:
+  class Iterator {
+  public:
+    // Persons are decoded into temporaries, so this can't be a forward
+    // iterator: those must hand out references
+    using iterator_category = input_iterator_tag;
+    using value_type = Person;
+    using difference_type = ptrdiff_t;
+    using pointer = const Person*;
+    using reference = Person;
+
+    Iterator(const PersonsView* view, size_t index) : view_(view), index_(index) {}
+
+    Person operator*() const {
+      return (*view_)[index_];
+    }
+
+    Iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator old = *this;
+      ++index_;
+      return old;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return index_ == other.index_;
+    }
+
+    bool operator!=(const Iterator& other) const {
+      return index_ != other.index_;
+    }
+
+  private:
+    const PersonsView* view_;
+    size_t index_;
+  };
+
+  explicit PersonsView(const string& path) {
+    using namespace persons_binary;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw runtime_error("Can't open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(HEADER_SIZE)) {
+      close(fd);
+      throw runtime_error("Not a persons file: " + path);
+    }
+    mapped_size_ = st.st_size;
+    data_ = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data_ == MAP_FAILED) {
+      throw runtime_error("Can't map " + path);
+    }
+
+    const auto* bytes = static_cast<const uint8_t*>(data_);
+    const uint64_t count = DecodeCount(bytes + 8);
+    // Reserved bytes stay zero until a later version gives them a meaning
+    const uint8_t* reserved = bytes + sizeof(MAGIC);
+    if (memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0
+        || any_of(reserved, bytes + 8, [](uint8_t b) { return b != 0; })
+        || count > (mapped_size_ - HEADER_SIZE) / 2
+        || HEADER_SIZE + 2 * count != mapped_size_) {
+      munmap(data_, mapped_size_);
+      throw runtime_error("Not a persons file: " + path);
+    }
+    size_ = count;
+    ages_ = bytes + HEADER_SIZE;
+    flags_ = ages_ + size_;
+  }
+
+  PersonsView(const PersonsView&) = delete;
+  PersonsView& operator=(const PersonsView&) = delete;
+
+  ~PersonsView() {
+    munmap(data_, mapped_size_);
+  }
+
+  size_t Size() const {
+    return size_;
+  }
+
+  Person operator[](size_t index) const {
+    using namespace persons_binary;
+    return {
+        ages_[index],
+        flags_[index] & FLAG_MALE ? Gender::MALE : Gender::FEMALE,
+        (flags_[index] & FLAG_EMPLOYED) != 0
+    };
+  }
+
+  Iterator begin() const {
+    return {this, 0};
+  }
+
+  Iterator end() const {
+    return {this, size_};
+  }
+
+  // The raw columns, for scans that don't need whole persons
+  const uint8_t* Ages() const {
+    return ages_;
+  }
+
+  const uint8_t* Flags() const {
+    return flags_;
+  }
+
+private:
+  void* data_ = nullptr;
+  size_t mapped_size_ = 0;
+  size_t size_ = 0;
+  const uint8_t* ages_ = nullptr;
+  const uint8_t* flags_ = nullptr;
+};
+
+// Gender/employment cells the age statistics are split into. Like the
+// partitions of ComputeStatsBySelection, any gender but FEMALE counts as male.
+const size_t AGE_CELL_COUNT = 4;
+
+size_t AgeCell(Gender gender, bool is_employed) {
+  return 2 * (gender == Gender::FEMALE ? 0 : 1) + is_employed;
+}
+
+// Age counts for each gender/employment cell. Ages are small, so all
+// seven medians come from the counts in one pass over the persons,
+// without copying or reordering them.
+class AgeHistogram {
+public:
+  // Ages outside [0, MAX_AGE] can't be counted
+  static constexpr int MAX_AGE = 150;
+
+  // Returns false, counting nothing, if the age is out of range
+  bool Add(const Person& person) {
+    if (person.age < 0 || person.age > MAX_AGE) {
+      return false;
+    }
+    ++counts_[AgeCell(person.gender, person.is_employed)][person.age];
+    return true;
+  }
+
+  // Histograms of disjoint slices merge into the histogram of the whole
+  void Merge(const AgeHistogram& other) {
+    for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+      for (int age = 0; age <= MAX_AGE; ++age) {
+        counts_[cell][age] += other.counts_[cell][age];
+      }
+    }
+  }
+
+  AgeStats Stats() const {
+    const unsigned female = CellBit(Gender::FEMALE, true) | CellBit(Gender::FEMALE, false);
+    const unsigned male = CellBit(Gender::MALE, true) | CellBit(Gender::MALE, false);
+    return {
+        Median(female | male),
+        Median(female),
+        Median(male),
+        Median(CellBit(Gender::FEMALE, true)),
+        Median(CellBit(Gender::FEMALE, false)),
+        Median(CellBit(Gender::MALE, true)),
+        Median(CellBit(Gender::MALE, false))
+    };
+  }
+
+private:
+  array<array<uint64_t, MAX_AGE + 1>, AGE_CELL_COUNT> counts_{};
+
+  static unsigned CellBit(Gender gender, bool is_employed) {
+    return 1u << AgeCell(gender, is_employed);
+  }
+
+  // The age ComputeMedianAge would pick for the persons of the cells in
+  // cell_mask: the one at index size / 2 in sorted order
+  int Median(unsigned cell_mask) const {
+    auto count_at = [&](int age) {
+      uint64_t count = 0;
+      for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+        if (cell_mask >> cell & 1) {
+          count += counts_[cell][age];
+        }
+      }
+      return count;
+    };
+
+    uint64_t total = 0;
+    for (int age = 0; age <= MAX_AGE; ++age) {
+      total += count_at(age);
+    }
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t seen = 0;
+    for (int age = 0; age <= MAX_AGE; ++age) {
+      seen += count_at(age);
+      if (seen > total / 2) {
+        return age;
+      }
+    }
+    return MAX_AGE;
+  }
+};
+
+// Empty if some age doesn't fit the histogram
+template <typename InputIt>
+optional<AgeHistogram> CountAges(InputIt range_begin, InputIt range_end) {
+  AgeHistogram histogram;
+  for (auto it = range_begin; it != range_end; ++it) {
+    if (!histogram.Add(*it)) {
+      return nullopt;
+    }
+  }
+  return histogram;
+}
+
+AgeStats ComputeStatsBySelection(vector<Person> persons);
+
+AgeStats ComputeStats(const vector<Person>& persons) {
+  if (auto histogram = CountAges(begin(persons), end(persons))) {
+    return histogram->Stats();
+  }
+  return ComputeStatsBySelection(persons);
+}
+
+AgeStats ComputeStats(const PersonsView& persons) {
+  if (auto histogram = CountAges(begin(persons), end(persons))) {
+    return histogram->Stats();
+  }
+  return ComputeStatsBySelection({begin(persons), end(persons)});
+}
+
+// Counts slices of the persons on thread_count threads and merges
+AgeStats ComputeStats(const vector<Person>& persons, size_t thread_count) {
+  // Smaller slices cost more in thread startup than they save
+  const size_t min_slice = 100'000;
+  thread_count = max<size_t>(1, min(thread_count, persons.size() / min_slice));
+  const size_t slice = (persons.size() + thread_count - 1) / thread_count;
+
+  vector<future<optional<AgeHistogram>>> futures;
+  for (size_t first = 0; first < persons.size(); first += slice) {
+    auto slice_begin = begin(persons) + first;
+    auto slice_end = begin(persons) + min(first + slice, persons.size());
+    futures.push_back(async(launch::async, [slice_begin, slice_end] {
+      return CountAges(slice_begin, slice_end);
+    }));
+  }
+
+  AgeHistogram histogram;
+  bool counted = true;
+  for (auto& f : futures) {
+    auto slice_histogram = f.get();
+    if (slice_histogram) {
+      histogram.Merge(*slice_histogram);
+    } else {
+      counted = false;
+    }
+  }
+  return counted ? histogram.Stats() : ComputeStatsBySelection(persons);
+}
+
+// Partitions a copy and selects each median; works for any ages
+AgeStats ComputeStatsBySelection(vector<Person> persons) {
   //                 persons
   //                |       |
   //          females        males
@@ -114,6 +500,311 @@ AgeStats ComputeStats(vector<Person> persons) {
   };
 }
 
+// KLL quantile sketch (Karnin, Lang and Liberty, 2016) over a stream of
+// values. Level h keeps items that each stand for 2^h values; a full level
+// is sorted and every other item, from a random start, moves up a level.
+// Level capacities shrink by 2/3 going down from the top, so the sketch
+// holds about 3k items however long the stream is.
+template <typename T>
+class KllSketch {
+public:
+  // 99% of quantiles come within 2.7 / k of the true rank fraction;
+  // streams shorter than k are kept whole and answered exactly
+  explicit KllSketch(size_t k = 200, uint64_t seed = 0)
+    : k_(max<size_t>(k, MIN_CAPACITY)), random_(seed) {
+    AddLevel();
+  }
+
+  static size_t KForRankError(double rank_error) {
+    return static_cast<size_t>(ceil(2.7 / rank_error));
+  }
+
+  void Add(const T& value) {
+    compactors_[0].push_back(value);
+    ++count_;
+    if (compactors_[0].size() >= capacities_[0]) {
+      Compress();
+    }
+  }
+
+  // Afterwards this sketch summarizes both streams
+  void Merge(const KllSketch& other) {
+    while (compactors_.size() < other.compactors_.size()) {
+      AddLevel();
+    }
+    for (size_t level = 0; level < other.compactors_.size(); ++level) {
+      compactors_[level].insert(end(compactors_[level]),
+                                begin(other.compactors_[level]), end(other.compactors_[level]));
+    }
+    count_ += other.count_;
+    Compress();
+  }
+
+  uint64_t Count() const {
+    return count_;
+  }
+
+  size_t RetainedSize() const {
+    size_t size = 0;
+    for (const auto& compactor : compactors_) {
+      size += compactor.size();
+    }
+    return size;
+  }
+
+  // The value at rank fraction * Count() in sorted order, give or take
+  // the rank error; fraction 0.5 matches ComputeMedianAge. Empty sketches
+  // report T().
+  T Quantile(double fraction) const {
+    vector<pair<T, uint64_t>> weighted;
+    weighted.reserve(RetainedSize());
+    for (size_t level = 0; level < compactors_.size(); ++level) {
+      for (const T& value : compactors_[level]) {
+        weighted.push_back({value, uint64_t{1} << level});
+      }
+    }
+    if (weighted.empty()) {
+      return T();
+    }
+    sort(begin(weighted), end(weighted));
+
+    const auto target = static_cast<uint64_t>(clamp(fraction, 0.0, 1.0) * count_);
+    uint64_t seen = 0;
+    for (const auto& [value, weight] : weighted) {
+      seen += weight;
+      if (seen > target) {
+        return value;
+      }
+    }
+    return weighted.back().first;
+  }
+
+private:
+  static constexpr size_t MIN_CAPACITY = 2;
+
+  size_t k_;
+  mt19937_64 random_;
+  vector<vector<T>> compactors_;
+  vector<size_t> capacities_;
+  uint64_t count_ = 0;
+
+  // A new top level pushes every capacity below it down by 2/3
+  void AddLevel() {
+    compactors_.emplace_back();
+    capacities_.resize(compactors_.size());
+    for (size_t level = 0; level < capacities_.size(); ++level) {
+      const size_t depth = capacities_.size() - 1 - level;
+      capacities_[level] = max(MIN_CAPACITY, static_cast<size_t>(k_ * pow(2.0 / 3.0, depth)));
+    }
+  }
+
+  void Compress() {
+    for (size_t level = 0; level < compactors_.size(); ++level) {
+      if (compactors_[level].size() >= capacities_[level]) {
+        Compact(level);
+      }
+    }
+  }
+
+  void Compact(size_t level) {
+    if (level + 1 == compactors_.size()) {
+      AddLevel();
+    }
+    auto& items = compactors_[level];
+    auto& next = compactors_[level + 1];
+    sort(begin(items), end(items));
+    // With an odd count the largest item waits for the next compaction
+    const size_t paired = items.size() / 2 * 2;
+    for (size_t i = random_() & 1; i < paired; i += 2) {
+      next.push_back(items[i]);
+    }
+    items.erase(begin(items), begin(items) + paired);
+  }
+};
+
+// Approximate medians of a stream of persons, one KLL sketch per
+// gender/employment cell; memory stays bounded however many persons
+// pass through. Sketches from different threads merge.
+class StreamingAgeStats {
+public:
+  explicit StreamingAgeStats(double rank_error = 0.01, uint64_t seed = 0) {
+    const size_t k = KllSketch<int>::KForRankError(rank_error);
+    for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+      cells_.emplace_back(k, seed + cell);
+    }
+  }
+
+  void Add(const Person& person) {
+    cells_[AgeCell(person.gender, person.is_employed)].Add(person.age);
+  }
+
+  void Merge(const StreamingAgeStats& other) {
+    for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+      cells_[cell].Merge(other.cells_[cell]);
+    }
+  }
+
+  uint64_t Count() const {
+    uint64_t count = 0;
+    for (const auto& cell : cells_) {
+      count += cell.Count();
+    }
+    return count;
+  }
+
+  // Every field holds the given quantile of its group instead of the
+  // median; groups without persons report 0
+  AgeStats Quantiles(double fraction) const {
+    const auto& employed_females = cells_[AgeCell(Gender::FEMALE, true)];
+    const auto& unemployed_females = cells_[AgeCell(Gender::FEMALE, false)];
+    const auto& employed_males = cells_[AgeCell(Gender::MALE, true)];
+    const auto& unemployed_males = cells_[AgeCell(Gender::MALE, false)];
+
+    auto females = employed_females;
+    females.Merge(unemployed_females);
+    auto males = employed_males;
+    males.Merge(unemployed_males);
+    auto total = females;
+    total.Merge(males);
+
+    return {
+        total.Quantile(fraction),
+        females.Quantile(fraction),
+        males.Quantile(fraction),
+        employed_females.Quantile(fraction),
+        unemployed_females.Quantile(fraction),
+        employed_males.Quantile(fraction),
+        unemployed_males.Quantile(fraction)
+    };
+  }
+
+  AgeStats Medians() const {
+    return Quantiles(0.5);
+  }
+
+private:
+  vector<KllSketch<int>> cells_;
+};
+
+// AgeStats kept up to date while persons come and go. Each
+// gender/employment cell keeps a Fenwick tree over ages, so an update
+// and any median both take O(log MAX_AGE) steps.
+class IncrementalAgeStats {
+public:
+  static constexpr int MAX_AGE = AgeHistogram::MAX_AGE;
+
+  // Returns false, changing nothing, if the age is out of range
+  bool Add(const Person& person) {
+    if (person.age < 0 || person.age > MAX_AGE) {
+      return false;
+    }
+    Update(AgeCell(person.gender, person.is_employed), person.age, 1);
+    return true;
+  }
+
+  // Returns false if no such person was added
+  bool Remove(const Person& person) {
+    if (person.age < 0 || person.age > MAX_AGE) {
+      return false;
+    }
+    const size_t cell = AgeCell(person.gender, person.is_employed);
+    if (CountBelow(cell, person.age + 1) == CountBelow(cell, person.age)) {
+      return false;
+    }
+    Update(cell, person.age, -1);
+    return true;
+  }
+
+  uint64_t Size() const {
+    return sizes_[0] + sizes_[1] + sizes_[2] + sizes_[3];
+  }
+
+  // Median age of the persons matching the given gender and employment;
+  // nullopt matches both. Same pick as ComputeMedianAge, 0 for nobody.
+  int MedianAge(optional<Gender> gender = nullopt, optional<bool> is_employed = nullopt) const {
+    unsigned cell_mask = 0;
+    for (Gender g : {Gender::FEMALE, Gender::MALE}) {
+      for (bool employed : {false, true}) {
+        if ((!gender || *gender == g) && (!is_employed || *is_employed == employed)) {
+          cell_mask |= 1u << AgeCell(g, employed);
+        }
+      }
+    }
+    return Median(cell_mask);
+  }
+
+  AgeStats Stats() const {
+    return {
+        MedianAge(),
+        MedianAge(Gender::FEMALE),
+        MedianAge(Gender::MALE),
+        MedianAge(Gender::FEMALE, true),
+        MedianAge(Gender::FEMALE, false),
+        MedianAge(Gender::MALE, true),
+        MedianAge(Gender::MALE, false)
+    };
+  }
+
+private:
+  // Tree size rounded up to a power of two for the top-down search
+  static constexpr size_t TREE_SIZE = 256;
+  static_assert(TREE_SIZE > MAX_AGE, "every age needs a node");
+
+  // trees_[cell][i] counts ages in (i - lowbit(i), i], shifted by one
+  array<array<uint64_t, TREE_SIZE + 1>, AGE_CELL_COUNT> trees_{};
+  array<uint64_t, AGE_CELL_COUNT> sizes_{};
+
+  void Update(size_t cell, int age, int delta) {
+    sizes_[cell] += delta;
+    for (size_t i = age + 1; i <= TREE_SIZE; i += i & -i) {
+      trees_[cell][i] += delta;
+    }
+  }
+
+  // Number of persons in the cell younger than age
+  uint64_t CountBelow(size_t cell, int age) const {
+    uint64_t count = 0;
+    for (size_t i = age; i > 0; i -= i & -i) {
+      count += trees_[cell][i];
+    }
+    return count;
+  }
+
+  // Walks all selected trees down together to the smallest age whose
+  // running count passes half of the total
+  int Median(unsigned cell_mask) const {
+    uint64_t total = 0;
+    for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+      if (cell_mask >> cell & 1) {
+        total += sizes_[cell];
+      }
+    }
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t remaining = total / 2 + 1;
+    size_t position = 0;
+    for (size_t step = TREE_SIZE; step > 0; step /= 2) {
+      const size_t next = position + step;
+      if (next > TREE_SIZE) {
+        continue;
+      }
+      uint64_t count = 0;
+      for (size_t cell = 0; cell < AGE_CELL_COUNT; ++cell) {
+        if (cell_mask >> cell & 1) {
+          count += trees_[cell][next];
+        }
+      }
+      if (count < remaining) {
+        position = next;
+        remaining -= count;
+      }
+    }
+    // position is the count of ages below the median, i.e. the median
+    return static_cast<int>(position);
+  }
+};
+
 void PrintStats(const AgeStats& stats,
                 ostream& out_stream = cout) {
   out_stream << "Median age = "
@@ -222,12 +913,397 @@ void TestPrintStats() {
     ASSERT_EQUAL(out.str(), expected.str());
 }
 
+vector<Person> RandomPersons(size_t count, int max_age, int seed) {
+  mt19937 gen(seed);
+  uniform_int_distribution<int> age(0, max_age);
+  uniform_int_distribution<int> coin(0, 1);
+  vector<Person> persons(count);
+  for (auto& person : persons) {
+    person = {age(gen), static_cast<Gender>(coin(gen)), coin(gen) == 1};
+  }
+  return persons;
+}
+
+void TestComputeStatsMatchesSelection() {
+  ASSERT_EQUAL(ComputeStats({}), ComputeStatsBySelection({}));
+  ASSERT_EQUAL(ComputeStats({{40, Gender::MALE, true}}), (AgeStats{40, 0, 40, 0, 0, 40, 0}));
+
+  for (size_t count : {1u, 2u, 3u, 10u, 101u, 1000u}) {
+    for (int seed = 0; seed < 20; ++seed) {
+      auto persons = RandomPersons(count, AgeHistogram::MAX_AGE, seed);
+      ASSERT_EQUAL(ComputeStats(persons), ComputeStatsBySelection(persons));
+    }
+  }
+
+  // Out of range ages go through selection
+  vector<Person> persons = {
+      {-5, Gender::FEMALE, true},
+      {1000, Gender::FEMALE, true},
+      {2000, Gender::MALE, false},
+  };
+  ASSERT_EQUAL(ComputeStats(persons), (AgeStats{1000, 1000, 2000, 1000, 0, 0, 2000}));
+
+  // Genders other than FEMALE count as male, as in selection
+  persons = {{30, Gender::FEMALE, true}, {50, static_cast<Gender>(7), false}};
+  ASSERT_EQUAL(ComputeStats(persons), ComputeStatsBySelection(persons));
+  ASSERT_EQUAL(ComputeStats(persons), (AgeStats{50, 30, 50, 30, 0, 0, 50}));
+}
+
+void TestComputeStatsSpeed() {
+  auto persons = RandomPersons(5'000'000, 100, 42);
+  AgeStats by_selection, by_histogram;
+  {
+    LOG_DURATION("ComputeStatsBySelection, 5M persons");
+    by_selection = ComputeStatsBySelection(persons);
+  }
+  {
+    LOG_DURATION("ComputeStats, 5M persons");
+    by_histogram = ComputeStats(persons);
+  }
+  ASSERT_EQUAL(by_histogram, by_selection);
+}
+
+void TestParallelComputeStats() {
+  for (size_t count : {0u, 1u, 1000u, 250'001u, 1'000'000u}) {
+    auto persons = RandomPersons(count, AgeHistogram::MAX_AGE, 42);
+    const AgeStats expected = ComputeStats(persons);
+    for (size_t thread_count : {1u, 2u, 3u, 8u}) {
+      ASSERT_EQUAL(ComputeStats(persons, thread_count), expected);
+    }
+  }
+
+  auto persons = RandomPersons(1'000'000, AgeHistogram::MAX_AGE, 43);
+  persons.back().age = 1000;
+  ASSERT_EQUAL(ComputeStats(persons, 4), ComputeStatsBySelection(persons));
+}
+
+void TestParallelComputeStatsSpeed() {
+  auto persons = RandomPersons(5'000'000, 100, 42);
+  const size_t max_threads = max(1u, thread::hardware_concurrency());
+  const AgeStats expected = ComputeStats(persons);
+  for (size_t thread_count = 1;; thread_count = min(thread_count * 2, max_threads)) {
+    AgeStats stats;
+    {
+      LOG_DURATION("ComputeStats, 5M persons, threads: " + to_string(thread_count));
+      stats = ComputeStats(persons, thread_count);
+    }
+    ASSERT_EQUAL(stats, expected);
+    if (thread_count == max_threads) {
+      break;
+    }
+  }
+}
+
+string MakeTempFile() {
+  char path[] = "/tmp/persons_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    throw runtime_error("Can't create temp file");
+  }
+  close(fd);
+  return path;
+}
+
+void TestPersonsBinaryRoundTrip() {
+  const string path = MakeTempFile();
+  auto persons = RandomPersons(10'000, 255, 42);
+  persons.push_back({0, Gender::MALE, false});
+  {
+    ofstream out(path, ios::binary);
+    WritePersonsBinary(persons, out);
+  }
+
+  {
+    PersonsView view(path);
+    ASSERT_EQUAL(view.Size(), persons.size());
+    ASSERT_EQUAL(vector<Person>(begin(view), end(view)), persons);
+    ASSERT_EQUAL(ComputeStats(view), ComputeStats(persons));
+  }
+
+  stringstream text;
+  text << persons.size() << "\n";
+  for (const Person& person : persons) {
+    text << person.age << " " << static_cast<int>(person.gender) << " " << person.is_employed << "\n";
+  }
+  {
+    ofstream out(path, ios::binary);
+    ConvertPersonsToBinary(text, out);
+  }
+  {
+    PersonsView view(path);
+    ASSERT_EQUAL(vector<Person>(begin(view), end(view)), persons);
+  }
+
+  {
+    ofstream out(path, ios::binary);
+    WritePersonsBinary({}, out);
+  }
+  ASSERT_EQUAL(PersonsView(path).Size(), 0u);
+
+  // Genders other than FEMALE come back as male
+  {
+    ofstream out(path, ios::binary);
+    WritePersonsBinary({{20, static_cast<Gender>(7), true}}, out);
+  }
+  ASSERT_EQUAL(PersonsView(path)[0], (Person{20, Gender::MALE, true}));
+  unlink(path.c_str());
+}
+
+void TestPersonsBinaryErrors() {
+  stringstream out;
+  try {
+    WritePersonsBinary({{256, Gender::MALE, true}}, out);
+    ASSERT(false);
+  } catch (const out_of_range&) {
+  }
+
+  const string path = MakeTempFile();
+  auto expect_rejected = [&path](const string& contents) {
+    {
+      ofstream file(path, ios::binary);
+      file << contents;
+    }
+    try {
+      PersonsView view(path);
+      ASSERT(false);
+    } catch (const runtime_error&) {
+    }
+  };
+
+  stringstream valid;
+  WritePersonsBinary({{30, Gender::FEMALE, true}, {40, Gender::MALE, false}}, valid);
+  expect_rejected("");
+  expect_rejected(valid.str().substr(0, valid.str().size() - 1));
+  expect_rejected("XSB1" + valid.str().substr(4));
+  expect_rejected("PSB1\x01" + valid.str().substr(5));
+  expect_rejected(valid.str() + "x");
+  unlink(path.c_str());
+
+  // Little endian count whatever the machine
+  ASSERT_EQUAL(valid.str().substr(8, 8), string("\x02\0\0\0\0\0\0\0", 8));
+
+  stringstream truncated_text("3\n30 0 1\n40 1 0\n");
+  try {
+    ConvertPersonsToBinary(truncated_text, out);
+    ASSERT(false);
+  } catch (const runtime_error&) {
+  }
+
+  ofstream closed;
+  try {
+    WritePersonsBinary({{30, Gender::FEMALE, true}}, closed);
+    ASSERT(false);
+  } catch (const runtime_error&) {
+  }
+}
+
+void TestPersonsBinarySpeed() {
+  const string text_path = MakeTempFile();
+  const string binary_path = MakeTempFile();
+  {
+    auto persons = RandomPersons(5'000'000, 100, 42);
+    ofstream out(text_path);
+    out << persons.size() << "\n";
+    for (const Person& person : persons) {
+      out << person.age << " " << static_cast<int>(person.gender) << " " << person.is_employed << "\n";
+    }
+  }
+
+  AgeStats from_text, from_binary;
+  {
+    LOG_DURATION("ReadPersons + ComputeStats, 5M persons");
+    ifstream in(text_path);
+    from_text = ComputeStats(ReadPersons(in));
+  }
+  {
+    LOG_DURATION("ConvertPersonsToBinary, 5M persons");
+    ifstream in(text_path);
+    ofstream out(binary_path, ios::binary);
+    ConvertPersonsToBinary(in, out);
+  }
+  {
+    LOG_DURATION("PersonsView + ComputeStats, 5M persons");
+    from_binary = ComputeStats(PersonsView(binary_path));
+  }
+  ASSERT_EQUAL(from_binary, from_text);
+  unlink(text_path.c_str());
+  unlink(binary_path.c_str());
+}
+
+void TestKllSketch() {
+  KllSketch<int> empty;
+  ASSERT_EQUAL(empty.Quantile(0.5), 0);
+
+  // Short streams are answered exactly, the way ComputeMedianAge does
+  for (size_t count : {1u, 2u, 5u, 100u}) {
+    auto persons = RandomPersons(count, 100, static_cast<int>(count));
+    KllSketch<int> sketch(200);
+    for (const Person& person : persons) {
+      sketch.Add(person.age);
+    }
+    ASSERT_EQUAL(sketch.Quantile(0.5), ComputeMedianAge(begin(persons), end(persons)));
+  }
+
+  const double rank_error = 0.01;
+  const int value_count = 1'000'000;
+  KllSketch<int> sketch(KllSketch<int>::KForRankError(rank_error));
+  mt19937 gen(42);
+  vector<int> values(value_count);
+  iota(begin(values), end(values), 0);
+  shuffle(begin(values), end(values), gen);
+  for (int value : values) {
+    sketch.Add(value);
+  }
+  ASSERT_EQUAL(sketch.Count(), static_cast<uint64_t>(value_count));
+  ASSERT(sketch.RetainedSize() < 3 * KllSketch<int>::KForRankError(rank_error));
+  // Values are 0..n-1, so a value is its own rank
+  for (double fraction : {0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 1.0}) {
+    double rank = sketch.Quantile(fraction) / static_cast<double>(value_count);
+    ASSERT(abs(rank - fraction) <= rank_error);
+  }
+}
+
+void TestStreamingAgeStats() {
+  const size_t thread_count = 4;
+  auto persons = RandomPersons(1'000'000, 100, 42);
+  const size_t slice = persons.size() / thread_count;
+
+  vector<future<StreamingAgeStats>> futures;
+  for (size_t i = 0; i < thread_count; ++i) {
+    futures.push_back(async(launch::async, [&persons, slice, i] {
+      StreamingAgeStats stats(0.01, i * 4);
+      for (size_t j = i * slice; j < (i + 1) * slice; ++j) {
+        stats.Add(persons[j]);
+      }
+      return stats;
+    }));
+  }
+  StreamingAgeStats stats = futures[0].get();
+  for (size_t i = 1; i < thread_count; ++i) {
+    stats.Merge(futures[i].get());
+  }
+  ASSERT_EQUAL(stats.Count(), static_cast<uint64_t>(persons.size()));
+
+  // Ages are uniform on 0..100, so 1% of rank is about one year
+  const AgeStats exact = ComputeStats(persons);
+  const AgeStats approximate = stats.Medians();
+  for (auto field : {&AgeStats::total, &AgeStats::females, &AgeStats::males,
+                     &AgeStats::employed_females, &AgeStats::unemployed_females,
+                     &AgeStats::employed_males, &AgeStats::unemployed_males}) {
+    ASSERT(abs(approximate.*field - exact.*field) <= 2);
+  }
+  ASSERT(abs(stats.Quantiles(0.9).total - 90) <= 2);
+  ASSERT_EQUAL(StreamingAgeStats().Medians(), (AgeStats{0, 0, 0, 0, 0, 0, 0}));
+
+  StreamingAgeStats odd_gender;
+  odd_gender.Add({50, static_cast<Gender>(7), false});
+  ASSERT_EQUAL(odd_gender.Medians(), (AgeStats{50, 0, 50, 0, 0, 0, 50}));
+}
+
+void TestStreamingAgeStatsSpeed() {
+  auto persons = RandomPersons(10'000'000, 100, 42);
+  StreamingAgeStats stats;
+  {
+    LOG_DURATION("StreamingAgeStats, 10M persons");
+    for (const Person& person : persons) {
+      stats.Add(person);
+    }
+    stats.Medians();
+  }
+}
+
+void TestIncrementalAgeStats() {
+  IncrementalAgeStats stats;
+  ASSERT_EQUAL(stats.Stats(), (AgeStats{0, 0, 0, 0, 0, 0, 0}));
+  ASSERT(!stats.Remove({30, Gender::MALE, true}));
+  ASSERT(!stats.Add({-1, Gender::MALE, true}));
+  ASSERT(!stats.Add({IncrementalAgeStats::MAX_AGE + 1, Gender::MALE, true}));
+
+  // Genders other than FEMALE count as male
+  ASSERT(stats.Add({50, static_cast<Gender>(7), false}));
+  ASSERT_EQUAL(stats.Stats(), (AgeStats{50, 0, 50, 0, 0, 0, 50}));
+  ASSERT(stats.Remove({50, Gender::MALE, false}));
+  ASSERT_EQUAL(stats.Size(), 0u);
+
+  mt19937 gen(42);
+  uniform_int_distribution<int> coin(0, 2);
+  vector<Person> population;
+  auto candidates = RandomPersons(20'000, IncrementalAgeStats::MAX_AGE, 43);
+  for (size_t t = 0; t < candidates.size(); ++t) {
+    // Grow two times out of three, otherwise drop a random person
+    if (population.empty() || coin(gen) != 0) {
+      ASSERT(stats.Add(candidates[t]));
+      population.push_back(candidates[t]);
+    } else {
+      size_t victim = uniform_int_distribution<size_t>(0, population.size() - 1)(gen);
+      ASSERT(stats.Remove(population[victim]));
+      swap(population[victim], population.back());
+      population.pop_back();
+    }
+    if (t % 97 == 0 || population.size() < 10) {
+      ASSERT_EQUAL(stats.Size(), population.size());
+      ASSERT_EQUAL(stats.Stats(), ComputeStats(population));
+    }
+  }
+  ASSERT_EQUAL(stats.Stats(), ComputeStats(population));
+
+  vector<Person> employed;
+  copy_if(begin(population), end(population), back_inserter(employed),
+      [](const Person& p) { return p.is_employed; });
+  ASSERT_EQUAL(stats.MedianAge(nullopt, true), ComputeMedianAge(begin(employed), end(employed)));
+
+  stringstream incremental, recomputed;
+  PrintStats(stats.Stats(), incremental);
+  PrintStats(ComputeStats(population), recomputed);
+  ASSERT_EQUAL(incremental.str(), recomputed.str());
+}
+
+void TestIncrementalAgeStatsSpeed() {
+  auto persons = RandomPersons(1'000'000, 100, 42);
+  auto arrivals = RandomPersons(1000, 100, 43);
+
+  int checksum = 0, expected_checksum = 0;
+  {
+    LOG_DURATION("ComputeStats after each of 1000 updates, 1M persons");
+    vector<Person> population = persons;
+    for (size_t i = 0; i < arrivals.size(); ++i) {
+      population[i] = arrivals[i];
+      expected_checksum += ComputeStats(population).total;
+    }
+  }
+  IncrementalAgeStats stats;
+  for (const Person& person : persons) {
+    stats.Add(person);
+  }
+  {
+    LOG_DURATION("IncrementalAgeStats, 1000 updates, 1M persons");
+    for (size_t i = 0; i < arrivals.size(); ++i) {
+      stats.Remove(persons[i]);
+      stats.Add(arrivals[i]);
+      checksum += stats.Stats().total;
+    }
+  }
+  ASSERT_EQUAL(checksum, expected_checksum);
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestComputeMedianAgeEmpty);
     RUN_TEST(tr, TestComputeMedianAgeMedian);
     RUN_TEST(tr, TestReadPersons);
     RUN_TEST(tr, TestComputeStats);
+    RUN_TEST(tr, TestComputeStatsMatchesSelection);
+    RUN_TEST(tr, TestComputeStatsSpeed);
+    RUN_TEST(tr, TestParallelComputeStats);
+    RUN_TEST(tr, TestParallelComputeStatsSpeed);
+    RUN_TEST(tr, TestPersonsBinaryRoundTrip);
+    RUN_TEST(tr, TestPersonsBinaryErrors);
+    RUN_TEST(tr, TestPersonsBinarySpeed);
+    RUN_TEST(tr, TestKllSketch);
+    RUN_TEST(tr, TestStreamingAgeStats);
+    RUN_TEST(tr, TestStreamingAgeStatsSpeed);
+    RUN_TEST(tr, TestIncrementalAgeStats);
+    RUN_TEST(tr, TestIncrementalAgeStatsSpeed);
     RUN_TEST(tr, TestPrintStats);
 
     // PrintStats(ComputeStats(ReadPersons()));
@@ -1,9 +1,13 @@
 #include <iostream>
 #include <string>
-#include <map>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
 #include <set>
 #include <vector>
 #include <algorithm>
+#include <numeric>
+#include <optional>
 
 using namespace std;
 
@@ -14,69 +18,95 @@ struct Booking {
     int room_count;
 };
 
-bool operator < (const Booking& lhs, const Booking& rhs) {
-    return lhs.time < rhs.time;
-}
+// Bookings of one hotel stored column-wise: the window search touches only
+// the dense times column and each query then scans a single other column.
+struct HotelLog {
+    vector<int> times;
+    vector<int> client_ids;
+    vector<int> room_counts;
+
+    void Append(const Booking& b) {
+        times.push_back(b.time);
+        client_ids.push_back(b.client_id);
+        room_counts.push_back(b.room_count);
+    }
+
+    size_t FirstAfter(int time) const {
+        return upper_bound(times.begin(), times.end(), time) - times.begin();
+    }
+
+    // Time never goes back, so bookings before pos are dead for good.
+    // They are dropped once they make up half of the log.
+    void DropBefore(size_t pos) {
+        if (pos == 0 || 2 * pos < times.size()) {
+            return;
+        }
+        times.erase(times.begin(), times.begin() + pos);
+        client_ids.erase(client_ids.begin(), client_ids.begin() + pos);
+        room_counts.erase(room_counts.begin(), room_counts.begin() + pos);
+    }
+};
 
 class BookingManager {
 public:
-    void Book(int time, const string& hotel_name, int client_id, int room_count) {
-        Booking b{time, client_id, room_count};
-        hotels_[hotel_name].push_back(b);
+    using HotelId = size_t;
+
+    void Book(int time, string_view hotel_name, int client_id, int room_count) {
+        auto& log = hotels_[InternHotel(hotel_name)];
+        log.Append({time, client_id, room_count});
         current_time_ = time;
+        log.DropBefore(log.FirstAfter(WindowStart()));
     }
-    size_t GetClients(const string& hotel_name) {
-        if (hotels_.count(hotel_name) == 0) {
+    size_t GetClients(string_view hotel_name) const {
+        auto id = FindHotel(hotel_name);
+        if (!id) {
             return 0;
         }
-        Booking fake{current_time_ - 86400, 0, 0};
-        auto& bookings = hotels_.at(hotel_name);
-        auto it = upper_bound(bookings.begin(), bookings.end(), fake, 
-                    [](const Booking& lhs, const Booking& rhs){
-                        return lhs.time < rhs.time;
-                    });
-        
-        set<int> client_ids;
-        while (it != bookings.end()) {
-            client_ids.insert(it->client_id);
-            ++it;
-        }
+        const auto& log = hotels_[*id];
+        auto first = log.client_ids.begin() + log.FirstAfter(WindowStart());
+        set<int> client_ids(first, log.client_ids.end());
 
         return client_ids.size();
     }
-    size_t GetRooms(const string& hotel_name) {
-        if (hotels_.count(hotel_name) == 0) {
+    size_t GetRooms(string_view hotel_name) const {
+        auto id = FindHotel(hotel_name);
+        if (!id) {
             return 0;
         }
-        Booking fake{current_time_ - 86400, 0, 0};
-        auto& bookings = hotels_.at(hotel_name);
-        auto it = upper_bound(bookings.begin(), bookings.end(), fake, 
-                    [](const Booking& lhs, const Booking& rhs){
-                        return lhs.time < rhs.time;
-                    });
-        
-        size_t total_rooms = 0;
-        while (it != bookings.end()) {
-            total_rooms += it->room_count;
-            ++it;
-        }
+        const auto& log = hotels_[*id];
+        auto first = log.room_counts.begin() + log.FirstAfter(WindowStart());
 
-        return total_rooms;
+        return accumulate(first, log.room_counts.end(), size_t{0});
     }
 
 private:
-    map<string, vector<Booking>> hotels_;
-    int current_time_;
+    // names_ owns the interned strings, so the views in hotel_ids_ stay valid
+    deque<string> names_;
+    unordered_map<string_view, HotelId> hotel_ids_;
+    vector<HotelLog> hotels_;
+    int current_time_ = 0;
 
 private:
-    void RemoveOld(const string& hotel_name) {
-        Booking fake{current_time_ - 86400, 0, 0};
-        auto& bookings = hotels_.at(hotel_name);
-        auto it = upper_bound(bookings.begin(), bookings.end(), fake, 
-                    [](const Booking& lhs, const Booking& rhs){
-                        return lhs.time < rhs.time;
-                    });
-        hotels_[hotel_name] = {it, bookings.end()};
+    HotelId InternHotel(string_view hotel_name) {
+        if (auto it = hotel_ids_.find(hotel_name); it != hotel_ids_.end()) {
+            return it->second;
+        }
+        HotelId id = hotels_.size();
+        hotel_ids_.emplace(names_.emplace_back(hotel_name), id);
+        hotels_.emplace_back();
+        return id;
+    }
+
+    optional<HotelId> FindHotel(string_view hotel_name) const {
+        auto it = hotel_ids_.find(hotel_name);
+        if (it == hotel_ids_.end()) {
+            return nullopt;
+        }
+        return it->second;
+    }
+
+    int WindowStart() const {
+        return current_time_ - 86400;
     }
 };
 
@@ -1,100 +1,383 @@
 #include "test_runner.h"
+#include "profile.h"
 
 #include <string>
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <set>
 #include <map>
 #include <list>
 #include <utility>
 #include <vector>
 #include <deque>
+#include <random>
 
 using namespace std;
 
 
-struct Node {
-    size_t id;
-    int priority = 0;
-};
-
-bool operator < (const Node& lhs, const Node& rhs) {
-    if (lhs.priority < rhs.priority) {
-        return true;
-    } else if (lhs.priority > rhs.priority) {
-        return false;
-    } else {
-        return lhs.id < rhs.id;
-    }
-};
-
-
+// Objects are kept in an indexed 4-ary max-heap of slots ordered by
+// priority and then by insertion order. Each Ref remembers where its slot
+// sits in the heap, so Promote is a sift-up in place without any
+// allocation. Slots freed by PopMax are reused by later Adds; an Id
+// carries the generation of its slot, so ids of popped objects stay
+// invalid after the slot is taken again.
 template <typename T>
 class PriorityCollection {
 public:
-    using Id = size_t;
-
-    struct Ref {
-        T value;
-        typename set<Node>::iterator set_it;
-    };
+    using Id = uint64_t;
 
-    PriorityCollection() {
-        refs_.reserve(1'000'000);
+    explicit PriorityCollection(size_t capacity = 0) {
+        refs_.reserve(capacity);
+        heap_.reserve(capacity);
     }
 
     Id Add(T object) {
-        Id id = refs_.size();
-        auto p = sorted_.insert({id});
-        refs_.push_back({move(object), p.first});
+        Id id = Append(move(object));
+        SiftUp(heap_.size() - 1);
         return id;
     }
 
+    // Appends all objects as leaves and restores the heap once: either
+    // by sifting up each of them or, for a large batch, by heapifying
+    // everything in O(n)
     template <typename ObjInputIt, typename IdOutputIt>
     void Add(ObjInputIt range_begin, ObjInputIt range_end,
              IdOutputIt ids_begin)
     {
+        size_t old_size = heap_.size();
         auto output_it = ids_begin;
         for (auto it = range_begin; it != range_end; ++it) {
-            *output_it = Add(move(*it));
+            *output_it = Append(move(*it));
             ++output_it;
         }
+        if (IsLargeBatch(heap_.size() - old_size)) {
+            Heapify();
+        } else {
+            for (size_t pos = old_size; pos < heap_.size(); ++pos) {
+                SiftUp(pos);
+            }
+        }
+    }
+
+    bool Empty() const {
+        return heap_.empty();
     }
 
     bool IsValid(Id id) const {
-        return id < refs_.size() && refs_[id].set_it != sorted_.end();
+        Slot slot = GetSlot(id);
+        return slot < refs_.size()
+            && refs_[slot].generation == GetGeneration(id)
+            && refs_[slot].heap_pos != NO_POS;
     }
 
     const T& Get(Id id) const {
-        return refs_[id].value;
+        return refs_[GetSlot(id)].value;
     }
 
     void Promote(Id id) {
-        auto& ref = refs_[id];
-        int priority = ref.set_it->priority;
-        sorted_.erase(ref.set_it);
-        auto p = sorted_.insert({id, ++priority});
-        ref.set_it = p.first;
+        auto& ref = refs_[GetSlot(id)];
+        ++ref.priority;
+        SiftUp(ref.heap_pos);
+    }
+
+    // Same as calling Promote delta times for each id; a negative delta
+    // lowers the priorities. A large batch changes all priorities first and
+    // then heapifies once in O(n); a small one sifts each slot right after
+    // changing it, as changing several priorities on one path before
+    // sifting could leave the heap broken.
+    template <typename IdInputIt>
+    void PromoteMany(IdInputIt range_begin, IdInputIt range_end, int delta = 1) {
+        if (IsLargeBatch(distance(range_begin, range_end))) {
+            for (auto it = range_begin; it != range_end; ++it) {
+                refs_[GetSlot(*it)].priority += delta;
+            }
+            Heapify();
+            return;
+        }
+        for (auto it = range_begin; it != range_end; ++it) {
+            auto& ref = refs_[GetSlot(*it)];
+            ref.priority += delta;
+            if (delta >= 0) {
+                SiftUp(ref.heap_pos);
+            } else {
+                SiftDown(ref.heap_pos);
+            }
+        }
     }
 
     pair<const T&, int> GetMax() const {
-        auto it = prev(sorted_.end());
-        return {refs_[it->id].value, it->priority};
+        const auto& ref = refs_[heap_.front()];
+        return {ref.value, ref.priority};
     }
 
     pair<T, int> PopMax() {
-        auto it = prev(sorted_.end());
-        auto p = make_pair(move(refs_[it->id].value), it->priority);
-        sorted_.erase(it);
-        refs_[it->id] = {T(), sorted_.end()};
+        Slot slot = heap_.front();
+        auto& ref = refs_[slot];
+        auto p = make_pair(move(ref.value), ref.priority);
+        ref.heap_pos = NO_POS;
+        ++ref.generation;
+        free_slots_.push_back(slot);
+        heap_.front() = heap_.back();
+        heap_.pop_back();
+        if (!heap_.empty()) {
+            refs_[heap_.front()].heap_pos = 0;
+            SiftDown(0);
+        }
         return p;
     }
 
 private:
+    using Slot = uint32_t;
+
+    static constexpr Slot NO_POS = numeric_limits<Slot>::max();
+    static constexpr size_t ARITY = 4;
+
+    struct Ref {
+        T value;
+        uint64_t order = 0;
+        int priority = 0;
+        uint32_t generation = 0;
+        Slot heap_pos = NO_POS;
+    };
+
     vector<Ref> refs_;
-    set<Node> sorted_;
+    vector<Slot> heap_;
+    vector<Slot> free_slots_;
+    uint64_t next_order_ = 0;
+
+private:
+    Id Append(T object) {
+        Slot slot;
+        if (free_slots_.empty()) {
+            slot = refs_.size();
+            refs_.push_back({move(object)});
+        } else {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+            refs_[slot].value = move(object);
+            refs_[slot].priority = 0;
+        }
+        auto& ref = refs_[slot];
+        ref.order = next_order_++;
+        heap_.push_back(slot);
+        ref.heap_pos = heap_.size() - 1;
+        return MakeId(slot, ref.generation);
+    }
+
+    // Heapify costs O(n), a sift-up per item O(log n) each
+    bool IsLargeBatch(size_t count) const {
+        return count > 0 && count >= heap_.size() / 3;
+    }
+
+    void Heapify() {
+        for (size_t pos = heap_.size() / ARITY + 1; pos-- > 0;) {
+            if (pos < heap_.size()) {
+                SiftDown(pos);
+            }
+        }
+    }
+
+    static Id MakeId(Slot slot, uint32_t generation) {
+        return static_cast<Id>(generation) << 32 | slot;
+    }
+    static Slot GetSlot(Id id) {
+        return static_cast<Slot>(id);
+    }
+    static uint32_t GetGeneration(Id id) {
+        return static_cast<uint32_t>(id >> 32);
+    }
+
+    bool Less(Slot lhs, Slot rhs) const {
+        const auto& lhs_ref = refs_[lhs];
+        const auto& rhs_ref = refs_[rhs];
+        return lhs_ref.priority < rhs_ref.priority
+            || (lhs_ref.priority == rhs_ref.priority && lhs_ref.order < rhs_ref.order);
+    }
+
+    void Place(size_t pos, Slot slot) {
+        heap_[pos] = slot;
+        refs_[slot].heap_pos = pos;
+    }
+
+    void SiftUp(size_t pos) {
+        Slot slot = heap_[pos];
+        while (pos > 0) {
+            size_t parent = (pos - 1) / ARITY;
+            if (!Less(heap_[parent], slot)) {
+                break;
+            }
+            Place(pos, heap_[parent]);
+            pos = parent;
+        }
+        Place(pos, slot);
+    }
+
+    void SiftDown(size_t pos) {
+        Slot slot = heap_[pos];
+        while (true) {
+            size_t first_child = pos * ARITY + 1;
+            if (first_child >= heap_.size()) {
+                break;
+            }
+            size_t last_child = min(first_child + ARITY, heap_.size());
+            size_t best = first_child;
+            for (size_t child = first_child + 1; child < last_child; ++child) {
+                if (Less(heap_[best], heap_[child])) {
+                    best = child;
+                }
+            }
+            if (!Less(slot, heap_[best])) {
+                break;
+            }
+            Place(pos, heap_[best]);
+            pos = best;
+        }
+        Place(pos, slot);
+    }
+};
+
+
+// Relaxed multi-queue for many threads: objects are spread over several
+// independently locked PriorityCollections. Add goes to a random shard
+// that isn't locked at the moment, PopMax peeks at two random shards and
+// pops from the one with the higher priority. PopMax thus returns one of
+// the highest-priority objects rather than the exact maximum, in exchange
+// for threads rarely waiting on the same lock.
+template <typename T>
+class ConcurrentPriorityCollection {
+public:
+    struct Id {
+        size_t shard;
+        typename PriorityCollection<T>::Id id;
+    };
+
+    // A shard count of 0 (say, from hardware_concurrency) means one shard
+    explicit ConcurrentPriorityCollection(size_t shard_count, size_t capacity = 0) {
+        shard_count = max<size_t>(1, shard_count);
+        for (size_t i = 0; i < shard_count; ++i) {
+            shards_.emplace_back(capacity / shard_count);
+        }
+    }
+
+    Id Add(T object) {
+        size_t index = RandomShard();
+        for (size_t attempt = 0; !shards_[index].mtx.try_lock(); ++attempt) {
+            if (attempt == shards_.size()) {
+                shards_[index].mtx.lock();
+                break;
+            }
+            index = RandomShard();
+        }
+        lock_guard guard(shards_[index].mtx, adopt_lock);
+        return {index, shards_[index].collection.Add(move(object))};
+    }
+
+    // Returns false if the object was already popped
+    bool Promote(Id id) {
+        auto& shard = shards_[id.shard];
+        lock_guard guard(shard.mtx);
+        if (!shard.collection.IsValid(id.id)) {
+            return false;
+        }
+        shard.collection.Promote(id.id);
+        return true;
+    }
+
+    // Returns nullopt only if every shard turned out to be empty
+    optional<pair<T, int>> PopMax() {
+        size_t first = RandomShard();
+        size_t second = RandomShard();
+        auto first_max = PeekMax(first);
+        auto second_max = PeekMax(second);
+        if (first_max || second_max) {
+            size_t best = !second_max || (first_max && *first_max >= *second_max)
+                ? first : second;
+            if (auto item = TryPop(best)) {
+                return item;
+            }
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (auto item = TryPop(i)) {
+                return item;
+            }
+        }
+        return nullopt;
+    }
+
+private:
+    struct alignas(64) Shard {
+        mutex mtx;
+        PriorityCollection<T> collection;
+
+        explicit Shard(size_t capacity) : collection(capacity) {}
+    };
+
+    // deque, as shards hold mutexes and can't be moved
+    deque<Shard> shards_;
+
+private:
+    size_t RandomShard() const {
+        thread_local minstd_rand gen(random_device{}());
+        return gen() % shards_.size();
+    }
+
+    optional<int> PeekMax(size_t index) {
+        auto& shard = shards_[index];
+        lock_guard guard(shard.mtx);
+        if (shard.collection.Empty()) {
+            return nullopt;
+        }
+        return shard.collection.GetMax().second;
+    }
+
+    optional<pair<T, int>> TryPop(size_t index) {
+        auto& shard = shards_[index];
+        lock_guard guard(shard.mtx);
+        if (shard.collection.Empty()) {
+            return nullopt;
+        }
+        return shard.collection.PopMax();
+    }
+};
+
+
+// Single PriorityCollection behind one mutex, the baseline for benchmarks
+template <typename T>
+class LockedPriorityCollection {
+public:
+    using Id = typename PriorityCollection<T>::Id;
+
+    Id Add(T object) {
+        lock_guard guard(mtx_);
+        return collection_.Add(move(object));
+    }
+    bool Promote(Id id) {
+        lock_guard guard(mtx_);
+        if (!collection_.IsValid(id)) {
+            return false;
+        }
+        collection_.Promote(id);
+        return true;
+    }
+    optional<pair<T, int>> PopMax() {
+        lock_guard guard(mtx_);
+        if (collection_.Empty()) {
+            return nullopt;
+        }
+        return collection_.PopMax();
+    }
+
+private:
+    mutex mtx_;
+    PriorityCollection<T> collection_;
 };
 
 
@@ -145,7 +428,342 @@ bool operator < (const S& lhs, const S& rhs) {
     return lhs.p < rhs.p;
 };
 
+void TestMatchesOrderedSet() {
+    mt19937 gen(42);
+    PriorityCollection<int> collection;
+    // Objects are numbered in the order they were added;
+    // (priority, number) of every live one, like the heap orders them
+    set<pair<int, int>> expected;
+    vector<PriorityCollection<int>::Id> ids;
+    vector<int> priorities;
+
+    for (int i = 0; i < 100'000; ++i) {
+        int action = gen() % 4;
+        if (action == 0 || expected.empty()) {
+            int number = ids.size();
+            ids.push_back(collection.Add(number));
+            priorities.push_back(0);
+            expected.insert({0, number});
+        } else if (action == 1) {
+            auto [priority, number] = *prev(expected.end());
+            auto item = collection.PopMax();
+            ASSERT_EQUAL(item.first, number);
+            ASSERT_EQUAL(item.second, priority);
+            expected.erase(prev(expected.end()));
+        } else {
+            int number = gen() % ids.size();
+            bool alive = expected.count({priorities[number], number}) > 0;
+            ASSERT_EQUAL(collection.IsValid(ids[number]), alive);
+            if (alive) {
+                expected.erase({priorities[number], number});
+                collection.Promote(ids[number]);
+                expected.insert({++priorities[number], number});
+            }
+        }
+        if (!expected.empty()) {
+            ASSERT_EQUAL(collection.GetMax().second, prev(expected.end())->first);
+        }
+    }
+}
+
+void TestSlotReuse() {
+    PriorityCollection<string> strings(4);
+    const auto first_id = strings.Add("first");
+    strings.PopMax();
+    ASSERT(!strings.IsValid(first_id));
+
+    const auto second_id = strings.Add("second");
+    ASSERT(!strings.IsValid(first_id));
+    ASSERT(strings.IsValid(second_id));
+    ASSERT(first_id != second_id);
+    ASSERT_EQUAL(strings.Get(second_id), "second");
+
+    // A long-running queue keeps just as many slots as it has live items
+    for (int i = 0; i < 1'000'000; ++i) {
+        const auto id = strings.Add(to_string(i));
+        strings.Promote(id);
+        ASSERT_EQUAL(strings.PopMax().first, to_string(i));
+    }
+    ASSERT(strings.IsValid(second_id));
+    ASSERT_EQUAL(strings.PopMax().first, "second");
+}
+
+void TestPromoteSpeed() {
+    const size_t object_count = 1'000'000;
+    const size_t promote_count = 10'000'000;
+
+    mt19937 gen(42);
+    vector<size_t> targets(promote_count);
+    for (auto& target : targets) {
+        // Skewed towards a hot set, like real schedulers
+        target = gen() % (gen() % 2 ? 1000 : object_count);
+    }
+
+    PriorityCollection<int> collection(object_count);
+    vector<PriorityCollection<int>::Id> ids(object_count);
+    {
+        LOG_DURATION("Add 1M objects");
+        for (size_t i = 0; i < object_count; ++i) {
+            ids[i] = collection.Add(i);
+        }
+    }
+    {
+        LOG_DURATION("10M promotions");
+        for (auto target : targets) {
+            collection.Promote(ids[target]);
+        }
+    }
+    {
+        LOG_DURATION("PopMax 1M objects");
+        int last_priority = numeric_limits<int>::max();
+        for (size_t i = 0; i < object_count; ++i) {
+            int priority = collection.PopMax().second;
+            ASSERT(priority <= last_priority);
+            last_priority = priority;
+        }
+    }
+}
+
+void TestBatchOperations() {
+    mt19937 gen(42);
+    PriorityCollection<int> batched, single;
+    vector<PriorityCollection<int>::Id> batched_ids, single_ids;
+    size_t live_count = 0;
+
+    for (int round = 0; round < 50; ++round) {
+        // Batches both smaller and larger than the heapify threshold
+        vector<int> objects(gen() % (round % 2 ? 2000 : 20));
+        iota(objects.begin(), objects.end(), batched_ids.size());
+        size_t old_size = batched_ids.size();
+        batched_ids.resize(old_size + objects.size());
+        batched.Add(objects.begin(), objects.end(), batched_ids.begin() + old_size);
+        for (int object : objects) {
+            single_ids.push_back(single.Add(object));
+        }
+        live_count += objects.size();
+
+        if (batched_ids.empty()) {
+            continue;
+        }
+        vector<size_t> targets(gen() % (round % 3 ? 3000 : 30));
+        for (auto& target : targets) {
+            target = gen() % batched_ids.size();
+        }
+        sort(targets.begin(), targets.end());
+        targets.erase(unique(targets.begin(), targets.end()), targets.end());
+        vector<PriorityCollection<int>::Id> promoted;
+        for (auto target : targets) {
+            if (batched.IsValid(batched_ids[target])) {
+                promoted.push_back(batched_ids[target]);
+                for (int i = 0; i < 3; ++i) {
+                    single.Promote(single_ids[target]);
+                }
+            }
+        }
+        batched.PromoteMany(promoted.begin(), promoted.end(), 3);
+
+        for (int i = 0; i < 100 && live_count > 0; ++i, --live_count) {
+            auto expected = single.PopMax();
+            auto item = batched.PopMax();
+            ASSERT_EQUAL(item.first, expected.first);
+            ASSERT_EQUAL(item.second, expected.second);
+        }
+    }
+}
+
+void TestNegativeDelta() {
+    mt19937 gen(42);
+    PriorityCollection<int> collection;
+    // (priority, number) of every object, like the heap orders them
+    set<pair<int, int>> expected;
+    vector<PriorityCollection<int>::Id> ids;
+    vector<int> priorities;
+    for (int number = 0; number < 1000; ++number) {
+        ids.push_back(collection.Add(number));
+        priorities.push_back(0);
+        expected.insert({0, number});
+    }
+
+    for (int round = 0; round < 200; ++round) {
+        // Mostly batches below the heapify threshold, some above it;
+        // the deltas both raise and lower priorities
+        size_t batch_size = round % 10 == 9 ? 600 : 1 + gen() % 8;
+        int delta = static_cast<int>(gen() % 21) - 10;
+        vector<int> numbers(ids.size());
+        iota(numbers.begin(), numbers.end(), 0);
+        shuffle(numbers.begin(), numbers.end(), gen);
+        numbers.resize(batch_size);
+        vector<PriorityCollection<int>::Id> batch;
+        for (int number : numbers) {
+            batch.push_back(ids[number]);
+            expected.erase({priorities[number], number});
+            priorities[number] += delta;
+            expected.insert({priorities[number], number});
+        }
+        collection.PromoteMany(batch.begin(), batch.end(), delta);
+        ASSERT_EQUAL(collection.GetMax().second, prev(expected.end())->first);
+    }
+
+    while (!expected.empty()) {
+        auto [priority, number] = *prev(expected.end());
+        auto item = collection.PopMax();
+        ASSERT_EQUAL(item.first, number);
+        ASSERT_EQUAL(item.second, priority);
+        expected.erase(prev(expected.end()));
+    }
+}
+
+void TestBatchSpeed() {
+    const size_t object_count = 1'000'000;
+    const size_t tick_count = 20;
+    const size_t promotions_per_tick = 500'000;
+
+    mt19937 gen(42);
+    vector<int> objects(object_count);
+    iota(objects.begin(), objects.end(), 0);
+    vector<size_t> targets(tick_count * promotions_per_tick);
+    for (auto& target : targets) {
+        target = gen() % object_count;
+    }
+
+    PriorityCollection<int> single, batched;
+    vector<PriorityCollection<int>::Id> single_ids(object_count), batched_ids(object_count);
+    {
+        LOG_DURATION("Add 1M objects one by one");
+        for (size_t i = 0; i < object_count; ++i) {
+            single_ids[i] = single.Add(objects[i]);
+        }
+    }
+    {
+        LOG_DURATION("Add 1M objects as a range");
+        batched.Add(objects.begin(), objects.end(), batched_ids.begin());
+    }
+    {
+        LOG_DURATION("Promote 500K ids per tick one by one");
+        for (auto target : targets) {
+            single.Promote(single_ids[target]);
+        }
+    }
+    {
+        LOG_DURATION("PromoteMany 500K ids per tick");
+        vector<PriorityCollection<int>::Id> tick(promotions_per_tick);
+        for (size_t i = 0; i < tick_count; ++i) {
+            for (size_t j = 0; j < promotions_per_tick; ++j) {
+                tick[j] = batched_ids[targets[i * promotions_per_tick + j]];
+            }
+            batched.PromoteMany(tick.begin(), tick.end());
+        }
+    }
+    ASSERT_EQUAL(batched.GetMax().second, single.GetMax().second);
+}
+
+void TestConcurrentCollection() {
+    const int thread_count = 4;
+    const int objects_per_thread = 20'000;
+
+    ConcurrentPriorityCollection<int> collection(8);
+    auto producer = [&collection](int thread) {
+        vector<ConcurrentPriorityCollection<int>::Id> ids;
+        for (int i = 0; i < objects_per_thread; ++i) {
+            ids.push_back(collection.Add(thread * objects_per_thread + i));
+        }
+        // Object i gets promoted i % 5 times
+        for (int i = 0; i < objects_per_thread; ++i) {
+            for (int j = 0; j < i % 5; ++j) {
+                ASSERT(collection.Promote(ids[i]));
+            }
+        }
+    };
+    vector<future<void>> producers;
+    for (int t = 0; t < thread_count; ++t) {
+        producers.push_back(async(launch::async, producer, t));
+    }
+    for (auto& f : producers) {
+        f.get();
+    }
+
+    auto consumer = [&collection] {
+        vector<pair<int, int>> popped;
+        while (auto item = collection.PopMax()) {
+            popped.push_back(*item);
+        }
+        return popped;
+    };
+    vector<future<vector<pair<int, int>>>> consumers;
+    for (int t = 0; t < thread_count; ++t) {
+        consumers.push_back(async(launch::async, consumer));
+    }
+    vector<bool> seen(thread_count * objects_per_thread);
+    for (auto& f : consumers) {
+        for (auto [object, priority] : f.get()) {
+            ASSERT(!seen[object]);
+            seen[object] = true;
+            ASSERT_EQUAL(priority, object % objects_per_thread % 5);
+        }
+    }
+    ASSERT(all_of(seen.begin(), seen.end(), [](bool b) { return b; }));
+
+    ConcurrentPriorityCollection<int> no_shards(0);
+    no_shards.Add(7);
+    ASSERT_EQUAL(no_shards.PopMax()->first, 7);
+    ASSERT(!no_shards.PopMax());
+}
+
+template <typename Collection>
+void RunWorkers(Collection& collection, size_t thread_count, int ops_per_thread) {
+    auto worker = [&collection, ops_per_thread](int seed) {
+        minstd_rand gen(seed);
+        vector<typename Collection::Id> ids;
+        for (int i = 0; i < ops_per_thread; ++i) {
+            switch (gen() % 4) {
+            case 0:
+                ids.push_back(collection.Add(i));
+                break;
+            case 1:
+                collection.PopMax();
+                break;
+            default:
+                if (!ids.empty()) {
+                    collection.Promote(ids[gen() % ids.size()]);
+                }
+            }
+        }
+    };
+    vector<future<void>> futures;
+    for (size_t t = 0; t < thread_count; ++t) {
+        futures.push_back(async(launch::async, worker, t));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+}
+
+void TestConcurrentScalability() {
+    const int total_ops = 2'000'000;
+    for (size_t thread_count : {1, 2, 4, 8, 16, 32}) {
+        const int ops_per_thread = total_ops / thread_count;
+        {
+            LockedPriorityCollection<int> locked;
+            LOG_DURATION("One mutex, " + to_string(thread_count) + " threads");
+            RunWorkers(locked, thread_count, ops_per_thread);
+        }
+        {
+            ConcurrentPriorityCollection<int> sharded(2 * thread_count);
+            LOG_DURATION("Multi-queue, " + to_string(thread_count) + " threads");
+            RunWorkers(sharded, thread_count, ops_per_thread);
+        }
+    }
+}
+
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestNoCopy);
+    RUN_TEST(tr, TestMatchesOrderedSet);
+    RUN_TEST(tr, TestSlotReuse);
+    RUN_TEST(tr, TestPromoteSpeed);
+    RUN_TEST(tr, TestBatchOperations);
+    RUN_TEST(tr, TestNegativeDelta);
+    RUN_TEST(tr, TestBatchSpeed);
+    RUN_TEST(tr, TestConcurrentCollection);
+    RUN_TEST(tr, TestConcurrentScalability);
 }
@@ -1,10 +1,33 @@
 #include "test_runner.h"
+#include "profile.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <random>
+#include <stdexcept>
+#include <vector>
 #include <tuple>
+#include <type_traits>
 
 using namespace std;
 
@@ -16,100 +39,1088 @@ struct Record {
     int karma;
 };
 
+// Conjunction of optional predicates, all bounds inclusive
+struct Query {
+    optional<pair<int, int>> timestamp;
+    optional<pair<int, int>> karma;
+    optional<string> user;
+
+    bool Matches(const Record& record) const {
+        return (!timestamp || (timestamp->first <= record.timestamp
+                               && record.timestamp <= timestamp->second))
+            && (!karma || (karma->first <= record.karma
+                           && record.karma <= karma->second))
+            && (!user || *user == record.user);
+    }
+};
+
+
+template <typename Key>
+class MultimapIndex {
+public:
+    using Handle = typename multimap<Key, const Record*>::iterator;
+
+    Handle Insert(const Key& key, const Record* record) {
+        return index_.insert({key, record});
+    }
+    void Erase(Handle handle) {
+        index_.erase(handle);
+    }
+
+    // Takes items sorted by key. Into an empty index (or one whose keys
+    // are all below the new ones) each item goes right before end(), and
+    // the hinted insert is amortized O(1). Otherwise items that land
+    // before existing keys miss the hint and take the usual O(log n) descent.
+    template <typename SetHandle>
+    void BulkInsert(const vector<pair<Key, const Record*>>& sorted_items,
+                    SetHandle set_handle) {
+        for (size_t i = 0; i < sorted_items.size(); ++i) {
+            set_handle(i, index_.emplace_hint(index_.end(), sorted_items[i]));
+        }
+    }
+
+    template <typename Callback>
+    void ForRange(const Key& low, const Key& high, Callback& callback) const {
+        auto start_it = index_.lower_bound(low);
+        auto end_it = index_.upper_bound(high);
+        for (auto it = start_it; it != end_it; ++it) {
+            if (!callback(*it->second)) {
+                break;
+            }
+        }
+    }
+
+    // Counts items in the range, but stops walking once limit is reached
+    size_t CountUpTo(const Key& low, const Key& high, size_t limit) const {
+        size_t count = 0;
+        auto end_it = index_.upper_bound(high);
+        for (auto it = index_.lower_bound(low); it != end_it && count < limit; ++it) {
+            ++count;
+        }
+        return count;
+    }
+
+private:
+    multimap<Key, const Record*> index_;
+};
+
+
+// Dead items of SortedVectorIndex outlive their records but still take part
+// in binary searches, so keys that view into a record are stored as copies
+template <typename Key>
+struct StoredKey {
+    using Type = Key;
+};
+
+template <>
+struct StoredKey<string_view> {
+    using Type = string;
+};
+
 
-class Database {
+// Flat index for scan-heavy workloads. Items live in one sorted vector,
+// erased ones are only marked dead, and fresh inserts go to a small sorted
+// buffer. Both are merged back into the main vector once the buffer grows
+// or dead items take up half of it.
+//
+// The buffer is capped at O(sqrt(n)) items: an insert into it then moves
+// O(sqrt(n)) items and a merge of O(n) items is paid for by sqrt(n)
+// inserts, so n inserts in a row cost O(n sqrt(n)) instead of O(n^2).
+template <typename Key>
+class SortedVectorIndex {
 public:
+    struct Handle {
+        Key key;
+        const Record* record;
+    };
+
+    Handle Insert(const Key& key, const Record* record) {
+        Item item{Stored(key), record, true};
+        pending_.insert(upper_bound(pending_.begin(), pending_.end(), item), item);
+        if (pending_.size() > PendingLimit()) {
+            Rebuild();
+        }
+        return {key, record};
+    }
+    void Erase(const Handle& handle) {
+        Item item{Stored(handle.key), handle.record, true};
+        auto pending_it = lower_bound(pending_.begin(), pending_.end(), item);
+        if (pending_it != pending_.end() && !(item < *pending_it)) {
+            pending_.erase(pending_it);
+            return;
+        }
+        auto [it, end_it] = equal_range(items_.begin(), items_.end(), item);
+        it = find_if(it, end_it, [](const Item& i) { return i.alive; });
+        if (it == end_it) {
+            throw invalid_argument("Erasing an item that is not in the index");
+        }
+        it->alive = false;
+        if (2 * ++dead_count_ > items_.size()) {
+            Rebuild();
+        }
+    }
+
+    // Takes items sorted by key and merges them in with a single rebuild
+    template <typename SetHandle>
+    void BulkInsert(const vector<pair<Key, const Record*>>& sorted_items,
+                    SetHandle set_handle) {
+        size_t middle = pending_.size();
+        pending_.reserve(middle + sorted_items.size());
+        for (size_t i = 0; i < sorted_items.size(); ++i) {
+            const auto& [key, record] = sorted_items[i];
+            pending_.push_back({Stored(key), record, true});
+            set_handle(i, Handle{key, record});
+        }
+        // Equal keys still have to be ordered by record
+        auto begin_it = pending_.begin() + middle;
+        for (auto it = begin_it; it != pending_.end();) {
+            auto run_end = find_if(it, pending_.end(),
+                [&it](const Item& item) { return it->key < item.key; });
+            sort(it, run_end);
+            it = run_end;
+        }
+        inplace_merge(pending_.begin(), begin_it, pending_.end());
+        Rebuild();
+    }
+
+    template <typename Callback>
+    void ForRange(const Key& low, const Key& high, Callback& callback) const {
+        auto [it, end_it] = KeyRange(items_, low, high);
+        auto [pending_it, pending_end] = KeyRange(pending_, low, high);
+        while (it != end_it || pending_it != pending_end) {
+            const Item* next;
+            if (pending_it == pending_end
+                || (it != end_it && !(pending_it->key < it->key))) {
+                next = &*it++;
+                if (!next->alive) {
+                    continue;
+                }
+            } else {
+                next = &*pending_it++;
+            }
+            if (!callback(*next->record)) {
+                break;
+            }
+        }
+    }
+
+    // Dead items are counted too, so this is an upper estimate
+    size_t CountUpTo(const Key& low, const Key& high, size_t limit) const {
+        auto [it, end_it] = KeyRange(items_, low, high);
+        auto [pending_it, pending_end] = KeyRange(pending_, low, high);
+        return min<size_t>(limit, (end_it - it) + (pending_end - pending_it));
+    }
+
+private:
+    using Stored = typename StoredKey<Key>::Type;
+
+    struct Item {
+        Stored key;
+        const Record* record;
+        bool alive;
+
+        bool operator<(const Item& other) const {
+            return key < other.key
+                || (!(other.key < key) && less<const Record*>()(record, other.record));
+        }
+    };
+    using Items = vector<Item>;
+
+    static constexpr size_t MIN_PENDING = 256;
+
+    Items items_;
+    Items pending_;
+    size_t dead_count_ = 0;
+
+private:
+    size_t PendingLimit() const {
+        return max(MIN_PENDING, 4 * static_cast<size_t>(sqrt(items_.size())));
+    }
+
+    static pair<typename Items::const_iterator, typename Items::const_iterator>
+    KeyRange(const Items& items, const Key& low, const Key& high) {
+        auto start_it = lower_bound(items.begin(), items.end(), low,
+            [](const Item& item, const Key& key) { return item.key < key; });
+        auto end_it = upper_bound(start_it, items.end(), high,
+            [](const Key& key, const Item& item) { return key < item.key; });
+        return {start_it, end_it};
+    }
+
+    void Rebuild() {
+        items_.erase(
+            remove_if(items_.begin(), items_.end(),
+                      [](const Item& item) { return !item.alive; }),
+            items_.end());
+        dead_count_ = 0;
+        size_t middle = items_.size();
+        items_.insert(items_.end(), pending_.begin(), pending_.end());
+        pending_.clear();
+        inplace_merge(items_.begin(), items_.begin() + middle, items_.end());
+    }
+};
+
+
+template <template <typename> typename Index>
+class BasicDatabase {
+public:
+    BasicDatabase() = default;
+    // A copy would keep handles into the indexes of the original.
+    // A move keeps them valid: map nodes stay where they are.
+    BasicDatabase(const BasicDatabase&) = delete;
+    BasicDatabase& operator=(const BasicDatabase&) = delete;
+    BasicDatabase(BasicDatabase&&) = default;
+    BasicDatabase& operator=(BasicDatabase&&) = default;
+
     bool Put(const Record& record) {
-        if (data_.count(record.id) > 0) {
+        auto [it, inserted] = data_.try_emplace(record.id);
+        if (!inserted) {
             return false;
         }
-        data_[record.id] = record;
-        timestamp_index_.insert({record.timestamp, record.id});
-        karma_index_.insert({record.karma, record.id});
-        user_index_.insert({record.user, record.id});
+        auto& entry = it->second;
+        entry.record = record;
+        const Record* ptr = &entry.record;
+        entry.timestamp_handle = timestamp_index_.Insert(ptr->timestamp, ptr);
+        entry.karma_handle = karma_index_.Insert(ptr->karma, ptr);
+        entry.user_handle = user_index_.Insert(ptr->user, ptr);
         return true;
     }
+    // Same as calling Put for every record, but each index is built from
+    // keys sorted once, and the three indexes are built in parallel.
+    // Returns the number of records added.
+    size_t BulkLoad(vector<Record> records) {
+        data_.reserve(data_.size() + records.size());
+        vector<Entry*> added;
+        added.reserve(records.size());
+        for (auto& record : records) {
+            auto [it, inserted] = data_.try_emplace(record.id);
+            if (inserted) {
+                it->second.record = move(record);
+                added.push_back(&it->second);
+            }
+        }
+
+        auto timestamps = async(launch::async, [this, &added] {
+            BuildIndex(timestamp_index_, added,
+                [](const Record& r) { return r.timestamp; },
+                [](Entry& e) -> auto& { return e.timestamp_handle; });
+        });
+        auto karmas = async(launch::async, [this, &added] {
+            BuildIndex(karma_index_, added,
+                [](const Record& r) { return r.karma; },
+                [](Entry& e) -> auto& { return e.karma_handle; });
+        });
+        BuildIndex(user_index_, added,
+            [](const Record& r) { return string_view(r.user); },
+            [](Entry& e) -> auto& { return e.user_handle; });
+        timestamps.get();
+        karmas.get();
+        return added.size();
+    }
     const Record* GetById(const string& id) const {
         auto it = data_.find(id);
         if (it == data_.end()) {
             return nullptr;
         }
-        return &it->second;
+        return &it->second.record;
     }
     bool Erase(const string& id) {
         auto it = data_.find(id);
         if (it == data_.end()) {
             return false;
         }
-        
-        auto& record = it->second;
-        RemoveFromIndex(timestamp_index_, {record.timestamp, id});
-        RemoveFromIndex(karma_index_, {record.karma, id});
-        RemoveFromIndex(user_index_, {record.user, id});
+
+        const auto& entry = it->second;
+        timestamp_index_.Erase(entry.timestamp_handle);
+        karma_index_.Erase(entry.karma_handle);
+        user_index_.Erase(entry.user_handle);
         data_.erase(it);
         return true;
     }
 
     template <typename Callback>
     void RangeByTimestamp(int low, int high, Callback callback) const {
-        auto range = make_pair(low, high);
-        RangeByIndex(timestamp_index_, range, callback);
+        timestamp_index_.ForRange(low, high, callback);
     }
 
     template <typename Callback>
     void RangeByKarma(int low, int high, Callback callback) const {
-        auto range = make_pair(low, high);
-        RangeByIndex(karma_index_, range, callback);
+        karma_index_.ForRange(low, high, callback);
     }
 
     template <typename Callback>
     void AllByUser(const string& user, Callback callback) const {
-        auto range = make_pair(user, user);
-        RangeByIndex(user_index_, range, callback);
+        user_index_.ForRange(user, user, callback);
+    }
+
+    // Scans the index whose range looks smallest and checks the remaining
+    // predicates on each record it points to. Ranges are counted in rounds
+    // with a growing limit, so a wide range is never walked in full just
+    // to learn that it's wider than another one. Counting stops at the
+    // smallest count seen so far and at the record count, and is skipped
+    // when there is only one index to choose.
+    template <typename Callback>
+    void Select(const Query& query, Callback callback) const {
+        auto filtered = [&query, &callback](const Record& record) {
+            return !query.Matches(record) || callback(record);
+        };
+
+        enum class Driver { TIMESTAMP, KARMA, USER };
+        vector<Driver> candidates;
+        if (query.timestamp) {
+            candidates.push_back(Driver::TIMESTAMP);
+        }
+        if (query.karma) {
+            candidates.push_back(Driver::KARMA);
+        }
+        if (query.user) {
+            candidates.push_back(Driver::USER);
+        }
+        auto count_up_to = [this, &query](Driver driver, size_t limit) {
+            switch (driver) {
+            case Driver::TIMESTAMP:
+                return timestamp_index_.CountUpTo(
+                    query.timestamp->first, query.timestamp->second, limit);
+            case Driver::KARMA:
+                return karma_index_.CountUpTo(
+                    query.karma->first, query.karma->second, limit);
+            default:
+                return user_index_.CountUpTo(*query.user, *query.user, limit);
+            }
+        };
+
+        Driver driver = candidates.empty() ? Driver::TIMESTAMP : candidates.front();
+        const size_t full_scan = data_.size() + 1;
+        for (size_t limit = min<size_t>(64, full_scan); candidates.size() > 1;
+             limit = min(limit * 4, full_scan)) {
+            size_t best = limit;
+            for (Driver candidate : candidates) {
+                if (size_t count = count_up_to(candidate, best); count < best) {
+                    best = count;
+                    driver = candidate;
+                }
+            }
+            if (best < limit) {
+                break;
+            }
+        }
+
+        switch (driver) {
+        case Driver::USER:
+            user_index_.ForRange(*query.user, *query.user, filtered);
+            break;
+        case Driver::KARMA:
+            karma_index_.ForRange(query.karma->first, query.karma->second, filtered);
+            break;
+        case Driver::TIMESTAMP:
+            auto [low, high] = query.timestamp.value_or(
+                make_pair(numeric_limits<int>::min(), numeric_limits<int>::max()));
+            timestamp_index_.ForRange(low, high, filtered);
+            break;
+        }
     }
 
 private:
-    unordered_map<string, Record> data_;
-    multimap<int, string> timestamp_index_;
-    multimap<int, string> karma_index_;
-    multimap<string, string> user_index_;
+    // Every record remembers its positions in the indexes,
+    // so Erase doesn't have to search for them.
+    // Nodes of data_ never move, so indexes can point right into them
+    // and user_index_ keys can view the user stored in the record
+    struct Entry {
+        Record record;
+        typename Index<int>::Handle timestamp_handle;
+        typename Index<int>::Handle karma_handle;
+        typename Index<string_view>::Handle user_handle;
+    };
+
+    unordered_map<string, Entry> data_;
+    Index<int> timestamp_index_;
+    Index<int> karma_index_;
+    Index<string_view> user_index_;
 
 private:
-    template<typename Key>
-    void RemoveFromIndex(multimap<Key, string>& index, 
-                         const pair<Key, string>& p) 
-    {
-        auto it = index.lower_bound(p.first);
-        while (it != index.end()) {
-            if (it->second == p.second) {
-                index.erase(it);
+    template <typename Key, typename GetKey, typename GetHandle>
+    static void BuildIndex(Index<Key>& index, const vector<Entry*>& entries,
+                           GetKey get_key, GetHandle get_handle) {
+        vector<pair<Key, const Record*>> items;
+        items.reserve(entries.size());
+        for (const Entry* entry : entries) {
+            items.push_back({get_key(entry->record), &entry->record});
+        }
+        // Stable, so equal keys keep the load order just like with Put
+        vector<size_t> order(items.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&items](size_t lhs, size_t rhs) {
+            return items[lhs].first < items[rhs].first;
+        });
+        vector<pair<Key, const Record*>> sorted_items;
+        sorted_items.reserve(items.size());
+        for (size_t i : order) {
+            sorted_items.push_back(items[i]);
+        }
+        index.BulkInsert(sorted_items, [&entries, &order, &get_handle](size_t i, auto handle) {
+            get_handle(*entries[order[i]]) = handle;
+        });
+    }
+};
+
+using Database = BasicDatabase<MultimapIndex>;
+using SortedDatabase = BasicDatabase<SortedVectorIndex>;
+
+
+// Index split into small sorted pages shared between the live index and
+// the views taken from it. Every view starts a new epoch, and a writer
+// modifies in place only pages created in the current epoch: older ones may
+// be seen by some view, so the writer switches to a private copy first.
+template <typename Key>
+class CowIndex {
+public:
+    struct Item {
+        Key key;
+        shared_ptr<const Record> record;
+
+        bool operator<(const Item& other) const {
+            return key < other.key
+                || (!(other.key < key)
+                    && less<const Record*>()(record.get(), other.record.get()));
+        }
+    };
+
+    struct Page {
+        vector<Item> items;
+        size_t epoch;
+    };
+
+    class View {
+    public:
+        View() = default;
+        explicit View(const vector<shared_ptr<Page>>& pages)
+            : pages_(pages.begin(), pages.end())
+        {}
+
+        template <typename Callback>
+        bool ForRange(const Key& low, const Key& high, Callback& callback) const {
+            auto page_it = lower_bound(pages_.begin(), pages_.end(), low,
+                [](const shared_ptr<const Page>& page, const Key& key) {
+                    return page->items.back().key < key;
+                });
+            for (; page_it != pages_.end(); ++page_it) {
+                const auto& items = (*page_it)->items;
+                auto it = lower_bound(items.begin(), items.end(), low,
+                    [](const Item& item, const Key& key) { return item.key < key; });
+                for (; it != items.end(); ++it) {
+                    if (high < it->key || !callback(*it->record)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+    private:
+        vector<shared_ptr<const Page>> pages_;
+    };
+
+    void Insert(Item item) {
+        if (pages_.empty()) {
+            pages_.push_back(make_shared<Page>(Page{{move(item)}, epoch_}));
+            return;
+        }
+        auto page_it = FindPage(item);
+        auto& items = Writable(*page_it).items;
+        items.insert(upper_bound(items.begin(), items.end(), item), move(item));
+        if (items.size() > 2 * PAGE_SIZE) {
+            auto tail = make_shared<Page>(Page{
+                {make_move_iterator(items.begin() + PAGE_SIZE),
+                 make_move_iterator(items.end())},
+                epoch_});
+            items.resize(PAGE_SIZE);
+            pages_.insert(next(page_it), move(tail));
+        }
+    }
+    void Erase(const Item& item) {
+        auto page_it = FindPage(item);
+        auto& items = Writable(*page_it).items;
+        items.erase(lower_bound(items.begin(), items.end(), item));
+        if (items.empty()) {
+            pages_.erase(page_it);
+        }
+    }
+
+    View GetView() const {
+        ++epoch_;
+        return View(pages_);
+    }
+
+private:
+    static constexpr size_t PAGE_SIZE = 256;
+
+    vector<shared_ptr<Page>> pages_;
+    mutable size_t epoch_ = 0;
+
+private:
+    typename vector<shared_ptr<Page>>::iterator FindPage(const Item& item) {
+        auto it = lower_bound(pages_.begin(), pages_.end(), item,
+            [](const shared_ptr<Page>& page, const Item& item) {
+                return page->items.back() < item;
+            });
+        return it == pages_.end() ? prev(it) : it;
+    }
+
+    Page& Writable(shared_ptr<Page>& page) {
+        if (page->epoch != epoch_) {
+            page = make_shared<Page>(Page{page->items, epoch_});
+        }
+        return *page;
+    }
+};
+
+
+// Consistent read-only state of a ConcurrentDatabase at some moment.
+// It stays valid and unchanged however the database is modified later.
+class DatabaseSnapshot {
+public:
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const {
+        timestamp_view_.ForRange(low, high, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const {
+        karma_view_.ForRange(low, high, callback);
+    }
+
+    template <typename Callback>
+    void AllByUser(const string& user, Callback callback) const {
+        user_view_.ForRange(user, user, callback);
+    }
+
+private:
+    friend class ConcurrentDatabase;
+
+    CowIndex<int>::View timestamp_view_;
+    CowIndex<int>::View karma_view_;
+    CowIndex<string_view>::View user_view_;
+};
+
+
+// Database that can be shared between threads. Writers are serialized by
+// a mutex, while range scans run without it over a snapshot, so a slow
+// callback never holds back Put or Erase.
+class ConcurrentDatabase {
+public:
+    bool Put(const Record& record) {
+        lock_guard guard(mutex_);
+        auto [it, inserted] = data_.try_emplace(record.id);
+        if (!inserted) {
+            return false;
+        }
+        it->second = make_shared<const Record>(record);
+        const auto& ptr = it->second;
+        timestamp_index_.Insert({ptr->timestamp, ptr});
+        karma_index_.Insert({ptr->karma, ptr});
+        user_index_.Insert({ptr->user, ptr});
+        snapshot_.reset();
+        return true;
+    }
+    shared_ptr<const Record> GetById(const string& id) const {
+        lock_guard guard(mutex_);
+        auto it = data_.find(id);
+        if (it == data_.end()) {
+            return nullptr;
+        }
+        return it->second;
+    }
+    bool Erase(const string& id) {
+        lock_guard guard(mutex_);
+        auto it = data_.find(id);
+        if (it == data_.end()) {
+            return false;
+        }
+
+        const auto& ptr = it->second;
+        timestamp_index_.Erase({ptr->timestamp, ptr});
+        karma_index_.Erase({ptr->karma, ptr});
+        user_index_.Erase({ptr->user, ptr});
+        data_.erase(it);
+        snapshot_.reset();
+        return true;
+    }
+
+    // Taken in O(n / page size) after a write, shared by readers otherwise
+    shared_ptr<const DatabaseSnapshot> GetSnapshot() const {
+        lock_guard guard(mutex_);
+        if (!snapshot_) {
+            auto snapshot = make_shared<DatabaseSnapshot>();
+            snapshot->timestamp_view_ = timestamp_index_.GetView();
+            snapshot->karma_view_ = karma_index_.GetView();
+            snapshot->user_view_ = user_index_.GetView();
+            snapshot_ = move(snapshot);
+        }
+        return snapshot_;
+    }
+
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const {
+        GetSnapshot()->RangeByTimestamp(low, high, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const {
+        GetSnapshot()->RangeByKarma(low, high, callback);
+    }
+
+    template <typename Callback>
+    void AllByUser(const string& user, Callback callback) const {
+        GetSnapshot()->AllByUser(user, callback);
+    }
+
+private:
+    mutable mutex mutex_;
+    unordered_map<string, shared_ptr<const Record>> data_;
+    CowIndex<int> timestamp_index_;
+    CowIndex<int> karma_index_;
+    CowIndex<string_view> user_index_;
+    mutable shared_ptr<const DatabaseSnapshot> snapshot_;
+};
+
+
+// Binary encoding shared by the write-ahead log and the snapshot file.
+// Integers are written in native byte order: both files are only ever
+// read back on the machine that wrote them.
+template <typename T>
+void AppendPod(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString(string& out, const string& s) {
+    AppendPod<uint32_t>(out, s.size());
+    out += s;
+}
+
+void AppendRecord(string& out, const Record& record) {
+    AppendString(out, record.id);
+    AppendString(out, record.title);
+    AppendString(out, record.user);
+    AppendPod<int32_t>(out, record.timestamp);
+    AppendPod<int32_t>(out, record.karma);
+}
+
+uint32_t Checksum(string_view data) {
+    uint32_t hash = 2'166'136'261u;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 16'777'619u;
+    }
+    return hash;
+}
+
+class ByteReader {
+public:
+    explicit ByteReader(string_view data) : data_(data) {}
+
+    bool Empty() const {
+        return data_.empty();
+    }
+    size_t Remaining() const {
+        return data_.size();
+    }
+
+    template <typename T>
+    bool ReadPod(T& value) {
+        if (data_.size() < sizeof(value)) {
+            return false;
+        }
+        memcpy(&value, data_.data(), sizeof(value));
+        data_.remove_prefix(sizeof(value));
+        return true;
+    }
+    bool ReadBytes(size_t size, string_view& bytes) {
+        if (data_.size() < size) {
+            return false;
+        }
+        bytes = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return true;
+    }
+    bool ReadString(string& s) {
+        uint32_t size;
+        string_view bytes;
+        if (!ReadPod(size) || !ReadBytes(size, bytes)) {
+            return false;
+        }
+        s.assign(bytes);
+        return true;
+    }
+    bool ReadRecord(Record& record) {
+        return ReadString(record.id) && ReadString(record.title)
+            && ReadString(record.user) && ReadPod(record.timestamp)
+            && ReadPod(record.karma);
+    }
+
+private:
+    string_view data_;
+};
+
+
+// Read-only mapping of a whole file; a missing file maps as empty
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw runtime_error("Can't open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw runtime_error("Can't stat " + path);
+        }
+        if (st.st_size > 0) {
+            size_ = st.st_size;
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            throw runtime_error("Can't map " + path);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (size_ > 0) {
+            munmap(data_, size_);
+        }
+    }
+
+    string_view View() const {
+        return {static_cast<const char*>(data_), size_};
+    }
+
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+
+void WriteFully(int fd, string_view data, const string& path) {
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            it++;
+            throw runtime_error("Can't write " + path);
         }
+        data.remove_prefix(written);
+    }
+}
+
+
+// Log of Put and Erase operations. Entries are buffered and written with
+// a single write and fdatasync per group, so one disk flush covers many
+// operations. Each entry is checksummed: a torn tail left by a crash is
+// detected and dropped on replay.
+class WriteAheadLog {
+public:
+    enum class Op : uint8_t {
+        PUT,
+        ERASE
     };
 
-    template<typename Key, typename Callback>
-    void RangeByIndex(const multimap<Key, string>& index, 
-                      const pair<Key, Key>& range, 
-                      Callback& callback) const 
+    WriteAheadLog(const string& path, size_t group_size)
+        : path_(path)
+        , group_size_(group_size)
+        , fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644))
     {
-        auto start_it = index.lower_bound(range.first);
-        auto end_it = index.upper_bound(range.second);
-        for (auto it = start_it; it != end_it; ++it) {
-            auto dit = data_.find(it->second);
-            if (dit != data_.end()) {
-                if (!callback(dit->second)) {
+        if (fd_ < 0) {
+            throw runtime_error("Can't open " + path);
+        }
+    }
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        try {
+            Commit();
+        } catch (...) {
+        }
+        close(fd_);
+    }
+
+    void LogPut(const Record& record) {
+        string payload;
+        AppendRecord(payload, record);
+        Append(Op::PUT, payload);
+    }
+    void LogErase(const string& id) {
+        string payload;
+        AppendString(payload, id);
+        Append(Op::ERASE, payload);
+    }
+
+    void Commit() {
+        if (pending_ == 0) {
+            return;
+        }
+        WriteFully(fd_, buffer_, path_);
+        if (fdatasync(fd_) != 0) {
+            throw runtime_error("Can't sync " + path_);
+        }
+        buffer_.clear();
+        pending_ = 0;
+    }
+
+    // Drops every entry, once they all made it into a snapshot
+    void Reset() {
+        Commit();
+        if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+            throw runtime_error("Can't truncate " + path_);
+        }
+        entry_count_ = 0;
+    }
+
+    size_t EntryCount() const {
+        return entry_count_;
+    }
+
+    // Calls on_put or on_erase for every intact entry of the log at path.
+    // Returns the size of the intact prefix, i.e. where a torn tail starts.
+    template <typename OnPut, typename OnErase>
+    static size_t Replay(const string& path, OnPut on_put, OnErase on_erase) {
+        MappedFile file(path);
+        ByteReader reader(file.View());
+        size_t valid_size = 0;
+        while (!reader.Empty()) {
+            Op op;
+            uint32_t size, checksum;
+            string_view payload;
+            if (!reader.ReadPod(op) || !reader.ReadPod(size)
+                || !reader.ReadBytes(size, payload) || !reader.ReadPod(checksum)
+                || checksum != Checksum(payload)) {
+                break;
+            }
+            // An entry that can't be decoded ends the log like a torn tail
+            ByteReader payload_reader(payload);
+            if (op == Op::PUT) {
+                Record record;
+                if (!payload_reader.ReadRecord(record) || !payload_reader.Empty()) {
                     break;
                 }
+                on_put(record);
+            } else if (op == Op::ERASE) {
+                string id;
+                if (!payload_reader.ReadString(id) || !payload_reader.Empty()) {
+                    break;
+                }
+                on_erase(id);
             } else {
-                continue;
+                break;
             }
-            
+            valid_size = file.View().size() - reader.Remaining();
         }
-    };
+        return valid_size;
+    }
+
+    // Cuts a torn tail off the log at path, so that new entries appended
+    // after it are not lost behind garbage on the next replay
+    static void Truncate(const string& path, size_t valid_size) {
+        int fd = open(path.c_str(), O_WRONLY);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw runtime_error("Can't open " + path);
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && static_cast<size_t>(st.st_size) > valid_size) {
+            ok = ftruncate(fd, valid_size) == 0 && fsync(fd) == 0;
+        }
+        close(fd);
+        if (!ok) {
+            throw runtime_error("Can't truncate " + path);
+        }
+    }
+
+private:
+    string path_;
+    size_t group_size_;
+    int fd_;
+    string buffer_;
+    size_t pending_ = 0;
+    size_t entry_count_ = 0;
+
+    void Append(Op op, const string& payload) {
+        AppendPod(buffer_, op);
+        AppendPod<uint32_t>(buffer_, payload.size());
+        buffer_ += payload;
+        AppendPod(buffer_, Checksum(payload));
+        ++entry_count_;
+        if (++pending_ >= group_size_) {
+            Commit();
+        }
+    }
 };
 
 
+// Database persisted in a directory as a snapshot plus a write-ahead log
+// of the operations made after it. Every checkpoint_every logged
+// operations the snapshot is rewritten and the log starts over.
+class DurableDatabase {
+public:
+    explicit DurableDatabase(const string& dir,
+                             size_t group_size = 64,
+                             size_t checkpoint_every = 1'000'000)
+        : dir_(dir)
+        , snapshot_path_(dir + "/snapshot.bin")
+        , checkpoint_every_(checkpoint_every)
+    {
+        const string log_path = dir + "/wal.bin";
+        LoadSnapshot();
+        size_t valid_size = WriteAheadLog::Replay(log_path,
+            [this](const Record& record) { db_.Put(record); },
+            [this](const string& id) { db_.Erase(id); });
+        WriteAheadLog::Truncate(log_path, valid_size);
+        log_ = make_unique<WriteAheadLog>(log_path, group_size);
+    }
+
+    // Operations are logged before they are applied: if logging throws,
+    // the database is left as it was
+    bool Put(const Record& record) {
+        if (db_.GetById(record.id)) {
+            return false;
+        }
+        log_->LogPut(record);
+        db_.Put(record);
+        MaybeCheckpoint();
+        return true;
+    }
+    bool Erase(const string& id) {
+        if (!db_.GetById(id)) {
+            return false;
+        }
+        log_->LogErase(id);
+        db_.Erase(id);
+        MaybeCheckpoint();
+        return true;
+    }
+
+    // Bulk loaded records are persisted with a checkpoint, not logged one by one
+    size_t BulkLoad(vector<Record> records) {
+        size_t added = db_.BulkLoad(move(records));
+        Checkpoint();
+        return added;
+    }
+
+    // Makes every operation so far durable without waiting for a full group
+    void Sync() {
+        log_->Commit();
+    }
+
+    void Checkpoint() {
+        string data(SNAPSHOT_MAGIC);
+        AppendPod<uint64_t>(data, 0);
+        uint64_t count = 0;
+        db_.RangeByTimestamp(numeric_limits<int>::min(), numeric_limits<int>::max(),
+            [&data, &count](const Record& record) {
+                AppendRecord(data, record);
+                ++count;
+                return true;
+            });
+        memcpy(data.data() + SNAPSHOT_MAGIC.size(), &count, sizeof(count));
+
+        const string tmp_path = snapshot_path_ + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Can't open " + tmp_path);
+        }
+        WriteFully(fd, data, tmp_path);
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        if (!synced || rename(tmp_path.c_str(), snapshot_path_.c_str()) != 0) {
+            throw runtime_error("Can't write " + snapshot_path_);
+        }
+        // The rename itself is durable only once the directory is synced,
+        // and the log must not be dropped before that
+        int dir_fd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) {
+            throw runtime_error("Can't open " + dir_);
+        }
+        synced = fsync(dir_fd) == 0;
+        close(dir_fd);
+        if (!synced) {
+            throw runtime_error("Can't sync " + dir_);
+        }
+        log_->Reset();
+    }
+
+    const Record* GetById(const string& id) const {
+        return db_.GetById(id);
+    }
+
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const {
+        db_.RangeByTimestamp(low, high, callback);
+    }
+
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const {
+        db_.RangeByKarma(low, high, callback);
+    }
+
+    template <typename Callback>
+    void AllByUser(const string& user, Callback callback) const {
+        db_.AllByUser(user, callback);
+    }
+
+    template <typename Callback>
+    void Select(const Query& query, Callback callback) const {
+        db_.Select(query, callback);
+    }
+
+private:
+    static constexpr string_view SNAPSHOT_MAGIC = "CDB1";
+
+    string dir_;
+    string snapshot_path_;
+    size_t checkpoint_every_;
+    Database db_;
+    unique_ptr<WriteAheadLog> log_;
+
+    void LoadSnapshot() {
+        MappedFile file(snapshot_path_);
+        ByteReader reader(file.View());
+        if (reader.Empty()) {
+            return;
+        }
+        string_view magic;
+        uint64_t count;
+        if (!reader.ReadBytes(SNAPSHOT_MAGIC.size(), magic)
+            || magic != SNAPSHOT_MAGIC || !reader.ReadPod(count)) {
+            throw runtime_error("Bad snapshot " + snapshot_path_);
+        }
+        // A record takes at least 20 bytes, which bounds a corrupted count
+        vector<Record> records;
+        records.reserve(min<uint64_t>(count, file.View().size() / 20));
+        for (uint64_t i = 0; i < count; ++i) {
+            if (!reader.ReadRecord(records.emplace_back())) {
+                throw runtime_error("Truncated snapshot " + snapshot_path_);
+            }
+        }
+        db_.BulkLoad(move(records));
+    }
+
+    void MaybeCheckpoint() {
+        if (log_->EntryCount() >= checkpoint_every_) {
+            Checkpoint();
+        }
+    }
+};
+
+
+template <typename Database>
 void TestRangeBoundaries() {
   const int good_karma = 1000;
   const int bad_karma = -10;
@@ -127,6 +1138,7 @@ void TestRangeBoundaries() {
   ASSERT_EQUAL(2, count);
 }
 
+template <typename Database>
 void TestSameUser() {
   Database db;
   db.Put({"id1", "Don't sell", "master", 1536107260, 1000});
@@ -141,6 +1153,7 @@ void TestSameUser() {
   ASSERT_EQUAL(2, count);
 }
 
+template <typename Database>
 void TestReplacement() {
   const string final_body = "Feeling sad";
 
@@ -154,10 +1167,622 @@ void TestReplacement() {
   ASSERT_EQUAL(final_body, record->title);
 }
 
+template <typename Database>
+void TestMove() {
+  static_assert(!is_copy_constructible_v<Database>);
+
+  Database db;
+  db.Put({"id1", "Hello there", "master", 1536107260, 1000});
+  db.Put({"id2", "O>>-<", "general2", 1536107260, -10});
+
+  // Indexes of the moved database still point at its records
+  Database moved = move(db);
+  ASSERT(moved.Erase("id1"));
+  ASSERT(moved.Put({"id3", "Rethink life", "master", 1536107261, 5}));
+  int count = 0;
+  moved.AllByUser("master", [&count](const Record& record) {
+    ASSERT_EQUAL(record.id, "id3");
+    ++count;
+    return true;
+  });
+  ASSERT_EQUAL(count, 1);
+}
+
+template <typename Database>
+vector<string> CollectByKarma(const Database& db, int low, int high) {
+  vector<string> ids;
+  db.RangeByKarma(low, high, [&ids](const Record& record) {
+    ids.push_back(record.id);
+    return true;
+  });
+  sort(ids.begin(), ids.end());
+  return ids;
+}
+
+void TestIndexesAgree() {
+  mt19937 gen(42);
+  uniform_int_distribution<int> id_dist(0, 5000);
+  uniform_int_distribution<int> karma_dist(-50, 50);
+
+  Database tree_db;
+  SortedDatabase flat_db;
+  for (int i = 0; i < 100'000; ++i) {
+    string id = to_string(id_dist(gen));
+    if (i % 3 == 0) {
+      ASSERT_EQUAL(tree_db.Erase(id), flat_db.Erase(id));
+    } else {
+      Record record{id, "title", "user", i, karma_dist(gen)};
+      ASSERT_EQUAL(tree_db.Put(record), flat_db.Put(record));
+    }
+    if (i % 1000 == 0) {
+      int low = karma_dist(gen);
+      ASSERT_EQUAL(CollectByKarma(tree_db, low, low + 10),
+                   CollectByKarma(flat_db, low, low + 10));
+    }
+  }
+  ASSERT_EQUAL(CollectByKarma(tree_db, -100, 100),
+               CollectByKarma(flat_db, -100, 100));
+}
+
+void TestEraseSpeed() {
+  const int record_count = 1'000'000;
+
+  vector<Record> records;
+  records.reserve(record_count);
+  for (int i = 0; i < record_count; ++i) {
+    // Few distinct keys, so every index holds long runs of equal keys
+    records.push_back({to_string(i), "title", "user" + to_string(i % 100),
+                       i % 1000, i % 10});
+  }
+
+  Database db;
+  {
+    LOG_DURATION("Put 1M records");
+    for (const auto& record : records) {
+      db.Put(record);
+    }
+  }
+  {
+    LOG_DURATION("Erase 1M records");
+    for (const auto& record : records) {
+      ASSERT(db.Erase(record.id));
+    }
+  }
+
+  int count = 0;
+  db.RangeByKarma(0, 10, [&count](const Record&) {
+    ++count;
+    return true;
+  });
+  ASSERT_EQUAL(count, 0);
+}
+
+template <typename Database>
+void RunRangeScans(const string& title, int record_count, int scan_count) {
+  Database db;
+  for (int i = 0; i < record_count; ++i) {
+    db.Put({to_string(i), "title", "user", i, i % 1000});
+  }
+
+  LOG_DURATION(title);
+  int64_t total = 0;
+  for (int i = 0; i < scan_count; ++i) {
+    int low = i * (record_count / scan_count) / 2;
+    db.RangeByTimestamp(low, low + record_count / 2, [&total](const Record& r) {
+      total += r.karma;
+      return true;
+    });
+  }
+  ASSERT(total > 0);
+}
+
+void TestRangeScanSpeed() {
+  RunRangeScans<Database>("Wide scans, multimap index", 200'000, 200);
+  RunRangeScans<SortedDatabase>("Wide scans, sorted vector index", 200'000, 200);
+}
+
+void TestSnapshotIsolation() {
+  ConcurrentDatabase db;
+  for (int i = 0; i < 1000; ++i) {
+    db.Put({to_string(i), "title", "user", i, i % 10});
+  }
+  auto snapshot = db.GetSnapshot();
+  for (int i = 0; i < 1000; i += 2) {
+    db.Erase(to_string(i));
+  }
+  for (int i = 1000; i < 2000; ++i) {
+    db.Put({to_string(i), "title", "user", i, i % 10});
+  }
+
+  int in_snapshot = 0;
+  snapshot->RangeByTimestamp(0, 5000, [&in_snapshot](const Record& r) {
+    ASSERT(r.timestamp < 1000);
+    ++in_snapshot;
+    return true;
+  });
+  ASSERT_EQUAL(in_snapshot, 1000);
+
+  int current = 0;
+  db.AllByUser("user", [&current](const Record&) {
+    ++current;
+    return true;
+  });
+  ASSERT_EQUAL(current, 1500);
+  ASSERT(db.GetById("0") == nullptr);
+  ASSERT_EQUAL(db.GetById("1")->timestamp, 1);
+}
+
+void TestConcurrentDatabase() {
+  ConcurrentDatabase db;
+  db.Put({"id1", "Hello there", "master", 1536107260, 1000});
+  db.Put({"id2", "O>>-<", "general2", 1536107260, -10});
+  ASSERT(!db.Put({"id1", "Again", "master", 1536107260, 5}));
+
+  int count = 0;
+  db.RangeByKarma(-10, 1000, [&count](const Record&) {
+    ++count;
+    return true;
+  });
+  ASSERT_EQUAL(count, 2);
+  ASSERT(db.Erase("id1"));
+  ASSERT(!db.Erase("id1"));
+}
+
+// The baseline for ConcurrentDatabase: one mutex around the whole Database
+class LockedDatabase {
+public:
+    bool Put(const Record& record) {
+        lock_guard guard(mutex_);
+        return db_.Put(record);
+    }
+    bool Erase(const string& id) {
+        lock_guard guard(mutex_);
+        return db_.Erase(id);
+    }
+    template <typename Callback>
+    void RangeByTimestamp(int low, int high, Callback callback) const {
+        lock_guard guard(mutex_);
+        db_.RangeByTimestamp(low, high, callback);
+    }
+    template <typename Callback>
+    void RangeByKarma(int low, int high, Callback callback) const {
+        lock_guard guard(mutex_);
+        db_.RangeByKarma(low, high, callback);
+    }
+
+private:
+    mutable mutex mutex_;
+    Database db_;
+};
+
+template <typename Database>
+void RunMixedLoad(const string& title, size_t writer_count, size_t reader_count) {
+  const int record_count = 100'000;
+  const int op_count = 20'000;
+
+  Database db;
+  for (int i = 0; i < record_count; ++i) {
+    db.Put({to_string(i), "title", "user", i, i % 1000});
+  }
+
+  LOG_DURATION(title);
+  vector<future<void>> futures;
+  for (size_t w = 0; w < writer_count; ++w) {
+    futures.push_back(async(launch::async, [&db, w] {
+      for (int i = 0; i < op_count; ++i) {
+        string id = to_string(record_count + w * op_count + i);
+        db.Put({id, "title", "user", i, i % 1000});
+        db.Erase(to_string((w * op_count + i) % record_count));
+      }
+    }));
+  }
+  for (size_t r = 0; r < reader_count; ++r) {
+    futures.push_back(async(launch::async, [&db] {
+      for (int i = 0; i < 20; ++i) {
+        int64_t total = 0;
+        db.RangeByTimestamp(0, record_count, [&total](const Record& rec) {
+          total += rec.karma;
+          return true;
+        });
+      }
+    }));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+void TestMixedLoadSpeed() {
+  RunMixedLoad<LockedDatabase>("Mixed load, global mutex", 2, 4);
+  RunMixedLoad<ConcurrentDatabase>("Mixed load, snapshots", 2, 4);
+}
+
+template <typename Database>
+void TestSelect() {
+  Database db;
+  db.Put({"id1", "Don't sell", "master", 1000, 50});
+  db.Put({"id2", "Rethink life", "master", 2000, 150});
+  db.Put({"id3", "Buy my goods", "master", 3000, 250});
+  db.Put({"id4", "Hello there", "general2", 2500, 500});
+
+  auto select = [&db](const Query& query) {
+    vector<string> ids;
+    db.Select(query, [&ids](const Record& r) {
+      ids.push_back(r.id);
+      return true;
+    });
+    sort(ids.begin(), ids.end());
+    return ids;
+  };
+
+  ASSERT_EQUAL(select({{}, {}, "master"}), vector<string>({"id1", "id2", "id3"}));
+  ASSERT_EQUAL(select({{{1500, 3000}}, {{100, 1000}}, "master"}),
+               vector<string>({"id2", "id3"}));
+  ASSERT_EQUAL(select({{{1500, 3000}}, {{100, 1000}}, {}}),
+               vector<string>({"id2", "id3", "id4"}));
+  ASSERT_EQUAL(select({{}, {{500, 500}}, "master"}), vector<string>());
+  ASSERT_EQUAL(select({}).size(), 4u);
+
+  int count = 0;
+  db.Select({{}, {}, "master"}, [&count](const Record&) {
+    return ++count < 2;
+  });
+  ASSERT_EQUAL(count, 2);
+}
+
+void TestSelectMatchesFilter() {
+  mt19937 gen(42);
+  uniform_int_distribution<int> value_dist(0, 999);
+  uniform_int_distribution<int> user_dist(0, 49);
+
+  SortedDatabase db;
+  vector<Record> records;
+  for (int i = 0; i < 20'000; ++i) {
+    records.push_back({to_string(i), "title", "user" + to_string(user_dist(gen)),
+                       value_dist(gen), value_dist(gen)});
+    db.Put(records.back());
+  }
+
+  for (int i = 0; i < 50; ++i) {
+    int ts_low = value_dist(gen), karma_low = value_dist(gen);
+    Query query{{{ts_low, ts_low + i * 20}}, {{karma_low, karma_low + 1000 - i * 20}}};
+    if (i % 2 == 0) {
+      query.user = "user" + to_string(user_dist(gen));
+    }
+    size_t expected = count_if(records.begin(), records.end(),
+        [&query](const Record& r) { return query.Matches(r); });
+    size_t count = 0;
+    db.Select(query, [&count](const Record&) {
+      ++count;
+      return true;
+    });
+    ASSERT_EQUAL(count, expected);
+  }
+}
+
+void TestSelectSpeed() {
+  const int record_count = 200'000;
+  Database db;
+  for (int i = 0; i < record_count; ++i) {
+    db.Put({to_string(i), "title", "user" + to_string(i % 10), i, i % 1000});
+  }
+  // User X with karma > 900 in the last 3600 seconds
+  const Query query{{{record_count - 3600, record_count}},
+                    {{901, numeric_limits<int>::max()}}, "user3"};
+
+  size_t by_user = 0, selected = 0;
+  {
+    LOG_DURATION("AllByUser + filter");
+    for (int i = 0; i < 100; ++i) {
+      db.AllByUser(*query.user, [&query, &by_user](const Record& r) {
+        by_user += query.Matches(r);
+        return true;
+      });
+    }
+  }
+  {
+    LOG_DURATION("Select");
+    for (int i = 0; i < 100; ++i) {
+      db.Select(query, [&selected](const Record&) {
+        ++selected;
+        return true;
+      });
+    }
+  }
+  ASSERT_EQUAL(selected, by_user);
+
+  // With one predicate there is nothing to choose: no counting rounds
+  const Query user_only{nullopt, nullopt, "user3"};
+  size_t all_by_user = 0, user_selected = 0;
+  {
+    LOG_DURATION("AllByUser, user only");
+    for (int i = 0; i < 100; ++i) {
+      db.AllByUser(*user_only.user, [&all_by_user](const Record&) {
+        ++all_by_user;
+        return true;
+      });
+    }
+  }
+  {
+    LOG_DURATION("Select, user only");
+    for (int i = 0; i < 100; ++i) {
+      db.Select(user_only, [&user_selected](const Record&) {
+        ++user_selected;
+        return true;
+      });
+    }
+  }
+  ASSERT_EQUAL(user_selected, all_by_user);
+}
+
+template <typename Database>
+void TestBulkLoad() {
+  mt19937 gen(42);
+  uniform_int_distribution<int> id_dist(0, 3000);
+  uniform_int_distribution<int> value_dist(-50, 50);
+
+  vector<Record> first, second;
+  for (int i = 0; i < 2000; ++i) {
+    first.push_back({to_string(id_dist(gen)), "first", "user" + to_string(i % 13),
+                     value_dist(gen), value_dist(gen)});
+    second.push_back({to_string(id_dist(gen)), "second", "user" + to_string(i % 13),
+                      value_dist(gen), value_dist(gen)});
+  }
+
+  Database put_db, bulk_db;
+  size_t put_count = 0;
+  for (const auto& record : first) {
+    put_count += put_db.Put(record);
+  }
+  ASSERT_EQUAL(bulk_db.BulkLoad(first), put_count);
+  // Loading into a non-empty database mixes with what is already there
+  for (size_t i = 0; i < second.size(); ++i) {
+    if (i % 2 == 0) {
+      put_db.Put(second[i]);
+      bulk_db.Put(second[i]);
+    }
+  }
+  for (const auto& record : second) {
+    put_db.Put(record);
+  }
+  bulk_db.BulkLoad(second);
+
+  ASSERT_EQUAL(CollectByKarma(bulk_db, -50, 50), CollectByKarma(put_db, -50, 50));
+  for (int i = 0; i < 3000; i += 7) {
+    string id = to_string(i);
+    ASSERT_EQUAL(bulk_db.Erase(id), put_db.Erase(id));
+  }
+  ASSERT_EQUAL(CollectByKarma(bulk_db, -50, 50), CollectByKarma(put_db, -50, 50));
+
+  vector<string> put_ids, bulk_ids;
+  put_db.RangeByTimestamp(-10, 10, [&put_ids](const Record& r) {
+    put_ids.push_back(r.id);
+    return true;
+  });
+  bulk_db.RangeByTimestamp(-10, 10, [&bulk_ids](const Record& r) {
+    bulk_ids.push_back(r.id);
+    return true;
+  });
+  sort(put_ids.begin(), put_ids.end());
+  sort(bulk_ids.begin(), bulk_ids.end());
+  ASSERT_EQUAL(bulk_ids, put_ids);
+}
+
+void TestBulkLoadSpeed() {
+  const int record_count = 1'000'000;
+  mt19937 gen(42);
+  uniform_int_distribution<int> value_dist(0, 1'000'000);
+
+  vector<Record> records;
+  records.reserve(record_count);
+  for (int i = 0; i < record_count; ++i) {
+    records.push_back({to_string(i), "title", "user" + to_string(i % 1000),
+                       value_dist(gen), value_dist(gen)});
+  }
+  {
+    Database db;
+    LOG_DURATION("Put 1M records one by one");
+    for (const auto& record : records) {
+      db.Put(record);
+    }
+  }
+  {
+    Database db;
+    LOG_DURATION("BulkLoad 1M records");
+    ASSERT_EQUAL(db.BulkLoad(records), records.size());
+  }
+}
+
+string MakeTempDir() {
+  char path[] = "/tmp/secondary_index_XXXXXX";
+  if (mkdtemp(path) == nullptr) {
+    throw runtime_error("Can't create temp dir");
+  }
+  return path;
+}
+
+void RemoveTempDir(const string& dir) {
+  for (const char* name : {"/snapshot.bin", "/snapshot.bin.tmp", "/wal.bin"}) {
+    unlink((dir + name).c_str());
+  }
+  rmdir(dir.c_str());
+}
+
+template <typename Database>
+int CountAll(const Database& db) {
+  int count = 0;
+  db.RangeByKarma(numeric_limits<int>::min(), numeric_limits<int>::max(),
+    [&count](const Record&) {
+      ++count;
+      return true;
+    });
+  return count;
+}
+
+void TestDurableRecovery() {
+  const string dir = MakeTempDir();
+  {
+    DurableDatabase db(dir);
+    db.Put({"id1", "Hello there", "master", 1536107260, 1000});
+    db.Put({"id2", "O>>-<", "general2", 1536107260, -10});
+    db.Put({"id3", "Rethink life", "master", 1536107261, 2000});
+    db.Erase("id2");
+  }
+  {
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), 2);
+    ASSERT(db.GetById("id2") == nullptr);
+    ASSERT_EQUAL(db.GetById("id3")->title, "Rethink life");
+    db.Put({"id2", "Back again", "general2", 1536107262, 5});
+  }
+  {
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), 3);
+    ASSERT_EQUAL(db.GetById("id2")->title, "Back again");
+  }
+  RemoveTempDir(dir);
+}
+
+void TestDurableCheckpoint() {
+  const string dir = MakeTempDir();
+  {
+    DurableDatabase db(dir, 16, 100);
+    for (int i = 0; i < 250; ++i) {
+      db.Put({to_string(i), "title", "user" + to_string(i % 7), i, i % 10});
+    }
+    for (int i = 0; i < 250; i += 5) {
+      db.Erase(to_string(i));
+    }
+  }
+  {
+    DurableDatabase db(dir, 16, 100);
+    ASSERT_EQUAL(CountAll(db), 200);
+    int count = 0;
+    db.AllByUser("user3", [&count](const Record& r) {
+      ASSERT_EQUAL(r.timestamp % 7, 3);
+      ++count;
+      return true;
+    });
+    ASSERT_EQUAL(count, 29);
+  }
+  RemoveTempDir(dir);
+}
+
+void TestTornLogTail() {
+  const string dir = MakeTempDir();
+  {
+    DurableDatabase db(dir);
+    db.Put({"id1", "Hello there", "master", 1536107260, 1000});
+    db.Put({"id2", "O>>-<", "general2", 1536107260, -10});
+    db.Sync();
+  }
+  {
+    // A crash in the middle of a group leaves a partial entry behind
+    int fd = open((dir + "/wal.bin").c_str(), O_WRONLY | O_APPEND);
+    WriteFully(fd, string("\0\x40\0\0\0partial", 10), dir);
+    close(fd);
+  }
+  {
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), 2);
+    db.Put({"id3", "After crash", "master", 1536107261, 1});
+  }
+  {
+    // The torn tail is cut off, so the entry logged after it is replayed
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), 3);
+    ASSERT(db.GetById("id3") != nullptr);
+  }
+  RemoveTempDir(dir);
+}
+
+void TestUndecodableLogEntry() {
+  auto append_entry = [](const string& dir, uint8_t op, const string& payload) {
+    string entry;
+    AppendPod(entry, op);
+    AppendPod<uint32_t>(entry, payload.size());
+    entry += payload;
+    AppendPod(entry, Checksum(payload));
+    int fd = open((dir + "/wal.bin").c_str(), O_WRONLY | O_APPEND);
+    WriteFully(fd, entry, dir);
+    close(fd);
+  };
+
+  // Intact checksums, but an unknown op or a payload too short for a record
+  const vector<pair<uint8_t, string>> entries = {
+      {7, string("\x03\0\0\0id1", 7)},
+      {0, string("\x03\0\0\0id", 6)},
+  };
+  for (const auto& [op, payload] : entries) {
+    const string dir = MakeTempDir();
+    {
+      DurableDatabase db(dir);
+      db.Put({"id1", "Hello there", "master", 1536107260, 1000});
+    }
+    append_entry(dir, op, payload);
+    {
+      DurableDatabase db(dir);
+      ASSERT_EQUAL(CountAll(db), 1);
+      db.Put({"id2", "After crash", "master", 1536107261, 1});
+    }
+    {
+      DurableDatabase db(dir);
+      ASSERT_EQUAL(CountAll(db), 2);
+    }
+    RemoveTempDir(dir);
+  }
+}
+
+void TestRecoverySpeed() {
+  const int record_count = 200'000;
+  const string dir = MakeTempDir();
+  {
+    DurableDatabase db(dir, 1024, record_count * 2);
+    for (int i = 0; i < record_count; ++i) {
+      db.Put({to_string(i), "title", "user" + to_string(i % 100), i, i % 1000});
+    }
+  }
+  {
+    LOG_DURATION("Recovery from log");
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), record_count);
+    db.Checkpoint();
+  }
+  {
+    LOG_DURATION("Recovery from snapshot");
+    DurableDatabase db(dir);
+    ASSERT_EQUAL(CountAll(db), record_count);
+  }
+  RemoveTempDir(dir);
+}
+
 int main() {
   TestRunner tr;
-  RUN_TEST(tr, TestRangeBoundaries);
-  RUN_TEST(tr, TestSameUser);
-  RUN_TEST(tr, TestReplacement);
+  RUN_TEST(tr, TestRangeBoundaries<Database>);
+  RUN_TEST(tr, TestSameUser<Database>);
+  RUN_TEST(tr, TestReplacement<Database>);
+  RUN_TEST(tr, TestRangeBoundaries<SortedDatabase>);
+  RUN_TEST(tr, TestSameUser<SortedDatabase>);
+  RUN_TEST(tr, TestReplacement<SortedDatabase>);
+  RUN_TEST(tr, TestMove<Database>);
+  RUN_TEST(tr, TestMove<SortedDatabase>);
+  RUN_TEST(tr, TestIndexesAgree);
+  RUN_TEST(tr, TestEraseSpeed);
+  RUN_TEST(tr, TestRangeScanSpeed);
+  RUN_TEST(tr, TestConcurrentDatabase);
+  RUN_TEST(tr, TestSnapshotIsolation);
+  RUN_TEST(tr, TestMixedLoadSpeed);
+  RUN_TEST(tr, TestDurableRecovery);
+  RUN_TEST(tr, TestDurableCheckpoint);
+  RUN_TEST(tr, TestTornLogTail);
+  RUN_TEST(tr, TestUndecodableLogEntry);
+  RUN_TEST(tr, TestRecoverySpeed);
+  RUN_TEST(tr, TestSelect<Database>);
+  RUN_TEST(tr, TestSelect<SortedDatabase>);
+  RUN_TEST(tr, TestSelectMatchesFilter);
+  RUN_TEST(tr, TestSelectSpeed);
+  RUN_TEST(tr, TestBulkLoad<Database>);
+  RUN_TEST(tr, TestBulkLoad<SortedDatabase>);
+  RUN_TEST(tr, TestBulkLoadSpeed);
   return 0;
 }